@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,175 +8,832 @@
 #include <string.h>
 #include <errno.h>
 #include "chunk_archive.h"
+#include "chunk_pool.h"
+#include "chunk_cache.h"
 
 #define CHUNK_LIST_DEFAULT_SIZE 1000
 
-typedef struct {
-    int size;
-    int num;
-    char *data;
-} disk_chunk;
+#define V1_HEADER_SIZE    (5 + sizeof(uint32_t))
+#define V1_FOOTER_SIZE    (2*sizeof(uint32_t) + 5)
+#define V2_HEADER_SIZE    (5 + 2*sizeof(uint32_t) + sizeof(uint64_t))
+#define HEADER_SIZE       (V2_HEADER_SIZE + sizeof(uint32_t))
+#define CHUNKS_POSITION   (5 + 2*sizeof(uint32_t))
+#define FOOTER_SIZE       (2*sizeof(uint64_t) + 5)
 
-archive create_archive_file(char *filename) {
-    int fd;
-    unsigned int chunks=0;
+// size of the archive header, the first chunk starts after it
+#define ARCHIVE_HEADER_SIZE(version) ((version) == 1 ? V1_HEADER_SIZE : (version) < 5 ? V2_HEADER_SIZE : HEADER_SIZE)
 
-    archive ar;
+// number of uint64_t fields in a chunk header and of tables in the index
+#define CHUNK_FIELDS(version) ((version) >= 8 ? 6 : (version) >= 7 ? 5 : (version) >= 4 ? 4 : 3)
+#define CHUNK_HEADER_SIZE     (CHUNK_FIELDS(ARCHIVE_VERSION)*sizeof(uint64_t))
 
-    if((fd=open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))==-1) {
-        printf("Could not create file %s: %s\n", filename, strerror(errno));
-        exit(0);
-    }
+// uint64_t fields of a directory entry before its name
+#define DIR_FIELDS 5
+
+// Read n bytes unless the end of the file is found first (pipes return short reads)
+static ssize_t read_full(int fd, void *buf, size_t n) {
+    size_t done = 0;
+    ssize_t r;
 
-    write(fd, "CHUNK", 5);
-    write(fd, &chunks, sizeof(unsigned int));
+    while(done < n && (r = read(fd, (char *) buf + done, n - done)) > 0)
+        done += r;
 
-    ar=malloc(sizeof(*ar));
+    return done;
+}
+
+static archive new_archive(int fd, char *name, int version, uint32_t codec) {
+    archive ar=malloc(sizeof(*ar));
 
     ar->fd             = fd;
     ar->chunks         = 0;
-    ar->name           = strdup(filename);
+    ar->name           = strdup(name);
     ar->archive_offset = NULL;
     ar->file_offset    = NULL;
     ar->chunk_size     = NULL;
+    ar->orig_size      = NULL;
+    ar->flags          = NULL;
+    ar->crc            = NULL;
     ar->table_size     = 0;
+    ar->files          = 0;
+    ar->dir            = NULL;
+    ar->dir_size       = 0;
+    ar->end            = HEADER_SIZE;
+    ar->next           = 0;
+    ar->version        = version;
+    ar->codec          = codec & ~ARCHIVE_CONTAINER;
+    ar->container      = (codec & ARCHIVE_CONTAINER) != 0;
+    ar->writing        = 0;
+    ar->stream         = 0;
+    ar->cache          = NULL;
 
     return ar;
 }
 
-void check_chunk_list_size(archive ar, int chunk_num) {
-    while(chunk_num >= ar->table_size) {
-        ar->archive_offset = realloc(ar->archive_offset, (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(unsigned int));
-        ar->chunk_size     = realloc(ar->chunk_size    , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(unsigned int));
-        ar->file_offset    = realloc(ar->file_offset   , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(unsigned int));
-        ar->table_size    += CHUNK_LIST_DEFAULT_SIZE;
+static void write_header(int fd, char *name, uint64_t chunks, uint32_t codec) {
+    unsigned char header[HEADER_SIZE];
+    uint32_t versioned = ARCHIVE_VERSIONED, version = ARCHIVE_VERSION;
+
+    memcpy(header, ARCHIVE_MAGIC, 5);
+    memcpy(header + 5, &versioned, sizeof(uint32_t));
+    memcpy(header + 5 + sizeof(uint32_t), &version, sizeof(uint32_t));
+    memcpy(header + CHUNKS_POSITION, &chunks, sizeof(uint64_t));
+    memcpy(header + V2_HEADER_SIZE, &codec, sizeof(uint32_t));
+    if(write(fd, header, HEADER_SIZE) != HEADER_SIZE) {
+        fprintf(stderr, "Could not write %s: %s\n", name, strerror(errno));
+        exit(EXIT_FAILURE);
     }
 }
 
-archive open_archive_file(char *filename) {
+archive create_archive_file(char *filename, uint32_t codec) {
     int fd;
-    unsigned int i;
-    char magic[5];
-    unsigned int chunks;
-    int offset;
     archive ar;
 
-    if((fd=open(filename, O_RDWR))==-1) {
-        printf("Could not open file %s: %s\n", filename, strerror(errno));
-        exit(0);
+    if((fd=open(filename, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))==-1) {
+        fprintf(stderr, "Could not create file %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    if(read(fd, magic, 5) < 5) {
-        printf("Could not read %s\n", filename);
-        exit(0);
+    write_header(fd, filename, ARCHIVE_INCOMPLETE, codec);
+
+    ar = new_archive(fd, filename, ARCHIVE_VERSION, codec);
+    ar->writing = 1;
+
+    return ar;
+}
+
+archive create_archive_stream(int fd, char *name, uint32_t codec) {
+    archive ar;
+
+    write_header(fd, name, ARCHIVE_STREAMED, codec);
+
+    ar = new_archive(fd, name, ARCHIVE_VERSION, codec);
+    ar->writing = 1;
+    ar->stream  = 1;
+
+    return ar;
+}
+
+void check_chunk_list_size(archive ar, uint64_t chunk_num) {
+    while(chunk_num >= ar->table_size) {
+        ar->archive_offset = realloc(ar->archive_offset, (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->chunk_size     = realloc(ar->chunk_size    , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->file_offset    = realloc(ar->file_offset   , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->orig_size      = realloc(ar->orig_size     , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->flags          = realloc(ar->flags         , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->crc            = realloc(ar->crc           , (ar->table_size+CHUNK_LIST_DEFAULT_SIZE)*sizeof(uint64_t));
+        ar->table_size    += CHUNK_LIST_DEFAULT_SIZE;
     }
+}
+
+static void alloc_tables(archive ar, uint64_t chunks) {
+    free(ar->archive_offset);
+    free(ar->chunk_size);
+    free(ar->file_offset);
+    free(ar->orig_size);
+    free(ar->flags);
+    free(ar->crc);
+
+    ar->archive_offset = calloc(chunks, sizeof(uint64_t));   // 0: no chunk found yet (see scan_chunks)
+    ar->chunk_size     = calloc(chunks, sizeof(uint64_t));
+    ar->file_offset    = calloc(chunks, sizeof(uint64_t));
+    ar->orig_size      = calloc(chunks, sizeof(uint64_t));
+    ar->flags          = calloc(chunks, sizeof(uint64_t));   // older versions have no flags
+    ar->crc            = calloc(chunks, sizeof(uint64_t));   // nor checksums
+    ar->table_size     = chunks;
+}
 
-    if(strncmp(magic, "CHUNK", 5)) {
-        printf("%s is not an archive file\n", filename);
-        exit(0);
+// Add a file to the directory, name is owned by the archive from now on
+static void append_file(archive ar, char *name, uint64_t mode, int64_t mtime, uint64_t first, uint64_t chunks) {
+    archive_file *f;
+
+    if(ar->files == ar->dir_size) {
+        ar->dir_size = ar->dir_size ? 2*ar->dir_size : 64;
+        ar->dir = realloc(ar->dir, ar->dir_size * sizeof(archive_file));
+        if(ar->dir == NULL) {
+            perror("Error allocating memory for the archive directory");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if(read(fd, &chunks, sizeof(unsigned int)) < (ssize_t) sizeof(unsigned int)) {
-        printf("Could not read %s\n", filename);
-        exit(0);
+    f = &ar->dir[ar->files++];
+    f->name   = name;
+    f->mode   = mode;
+    f->mtime  = mtime;
+    f->first  = first;
+    f->chunks = chunks;
+}
+
+static int cmp_file(const void *a, const void *b) {
+    return strcmp(((archive_file *) a)->name, ((archive_file *) b)->name);
+}
+
+// Load the directory block of a version 9 archive, size bytes at offset.
+// Returns 0 if it is not valid.
+static int read_dir(archive ar, uint64_t offset, uint64_t size) {
+    unsigned char *buf, *p, *end;
+    uint64_t files;
+
+    if(size < sizeof(uint64_t))
+        return 0;
+
+    buf = malloc(size);
+    if(pread(ar->fd, buf, size, offset) != (ssize_t) size) {
+        free(buf);
+        return 0;
     }
 
-    ar = malloc(sizeof(*ar));
+    memcpy(&files, buf, sizeof(uint64_t));
+    p   = buf + sizeof(uint64_t);
+    end = buf + size;
 
-    ar->fd             = fd;
-    ar->chunks         = 0;
-    ar->name           = strdup(filename);
-    ar->archive_offset = malloc(chunks * sizeof(unsigned int));
-    ar->chunk_size     = malloc(chunks * sizeof(unsigned int));
-    ar->file_offset    = malloc(chunks * sizeof(unsigned int));
-    ar->table_size     = 0;
+    for(uint64_t i = 0; i < files; i++) {
+        uint64_t fields[DIR_FIELDS];
+        char *name;
+
+        if((uint64_t) (end - p) < sizeof(fields))
+            break;
+        memcpy(fields, p, sizeof(fields));
+        p += sizeof(fields);
+        if(fields[4] > (uint64_t) (end - p) ||
+           fields[0] > ar->chunks || fields[1] > ar->chunks - fields[0])
+            break;
+
+        name = malloc(fields[4] + 1);
+        memcpy(name, p, fields[4]);
+        name[fields[4]] = '\0';
+        p += fields[4];
+
+        append_file(ar, name, fields[2], (int64_t) fields[3], fields[0], fields[1]);
+    }
+    free(buf);
+
+    if(ar->files != files || p != end)
+        return 0;
+
+    if(ar->files > 0)                             // dir is NULL for a single file
+        qsort(ar->dir, ar->files, sizeof(archive_file), cmp_file);
+    return 1;
+}
+
+// Load the 32 bit offset tables of a version 1 archive index
+static int read_v1_index(archive ar, uint64_t chunks, off_t file_size) {
+    unsigned char footer[V1_FOOTER_SIZE];
+    uint32_t index_offset, index_chunks, *table;
+    size_t table_bytes;
+    uint64_t i;
+
+    if(file_size < (off_t) (V1_HEADER_SIZE + V1_FOOTER_SIZE) ||
+       chunks > (file_size - V1_HEADER_SIZE - V1_FOOTER_SIZE) / (3*sizeof(uint32_t)))
+        return 0;
+    table_bytes = chunks * sizeof(uint32_t);
+
+    if(pread(ar->fd, footer, V1_FOOTER_SIZE, file_size - V1_FOOTER_SIZE) != V1_FOOTER_SIZE)
+        return 0;
+
+    memcpy(&index_offset, footer, sizeof(uint32_t));
+    memcpy(&index_chunks, footer + sizeof(uint32_t), sizeof(uint32_t));
+
+    if(strncmp((char *) footer + 2*sizeof(uint32_t), ARCHIVE_FOOTER_MAGIC, 5) ||
+       index_chunks != chunks || index_offset < V1_HEADER_SIZE ||
+       index_offset + 3*table_bytes + V1_FOOTER_SIZE != file_size)
+        return 0;
+
+    table = malloc(3*table_bytes);
+    if(pread(ar->fd, table, 3*table_bytes, index_offset) != (ssize_t) (3*table_bytes)) {
+        free(table);
+        return 0;
+    }
+
+    alloc_tables(ar, chunks);
 
     for(i=0; i<chunks; i++) {
-        int size, chunk_num;
-        read(fd, &size,      sizeof(unsigned int));
-        read(fd, &chunk_num, sizeof(unsigned int));
-        read(fd, &offset,    sizeof(unsigned int));
+        ar->archive_offset[i] = table[i];
+        ar->file_offset[i]    = table[chunks + i];
+        ar->chunk_size[i]     = table[2*chunks + i];
+        ar->orig_size[i]      = 0;
+    }
+    free(table);
 
-        ar->archive_offset[chunk_num] = lseek(fd, 0, SEEK_CUR);
+    ar->chunks = chunks;
+    return 1;
+}
+
+// Load the offset tables from the index block at the end of the archive.
+// Returns 0 if the archive has no valid footer. The chunk count of streamed
+// archives (ARCHIVE_STREAMED) is taken from the footer.
+static int read_index(archive ar, uint64_t chunks) {
+    struct stat st;
+    unsigned char footer[FOOTER_SIZE];
+    uint64_t index_offset, index_chunks, footer_offset, dir_bytes = 0;
+    size_t table_bytes;
+    int tables = CHUNK_FIELDS(ar->version);
+    struct iovec iov[6];
+
+    if(fstat(ar->fd, &st) == -1)
+        return 0;
+
+    if(ar->version == 1)
+        return read_v1_index(ar, chunks, st.st_size);
+
+    if(st.st_size < (off_t) (ARCHIVE_HEADER_SIZE(ar->version) + FOOTER_SIZE))
+        return 0;
+    footer_offset = st.st_size - FOOTER_SIZE;
+
+    if(pread(ar->fd, footer, FOOTER_SIZE, st.st_size - FOOTER_SIZE) != FOOTER_SIZE)
+        return 0;
+
+    memcpy(&index_offset, footer, sizeof(uint64_t));
+    memcpy(&index_chunks, footer + sizeof(uint64_t), sizeof(uint64_t));
+
+    if(chunks == ARCHIVE_STREAMED)
+        chunks = index_chunks;
+
+    // the footer is not trusted: the index must lie between the header and
+    // the footer, and its tables must fit there (checked without overflowing)
+    if(strncmp((char *) footer + 2*sizeof(uint64_t), ARCHIVE_FOOTER_MAGIC, 5) ||
+       index_chunks != chunks ||
+       index_offset < ARCHIVE_HEADER_SIZE(ar->version) || index_offset > footer_offset ||
+       chunks > (footer_offset - index_offset) / (tables*sizeof(uint64_t)))
+        return 0;
+    table_bytes = chunks * sizeof(uint64_t);
+
+    dir_bytes = footer_offset - index_offset - tables*table_bytes;
+    if(ar->version < 9 && dir_bytes != 0)        // older versions have no directory
+        return 0;
+
+    alloc_tables(ar, chunks);
+
+    iov[0].iov_base = ar->archive_offset;
+    iov[0].iov_len  = table_bytes;
+    iov[1].iov_base = ar->file_offset;
+    iov[1].iov_len  = table_bytes;
+    iov[2].iov_base = ar->chunk_size;
+    iov[2].iov_len  = table_bytes;
+    iov[3].iov_base = ar->orig_size;
+    iov[3].iov_len  = table_bytes;
+    iov[4].iov_base = ar->flags;
+    iov[4].iov_len  = table_bytes;
+    iov[5].iov_base = ar->crc;
+    iov[5].iov_len  = table_bytes;
+
+    if(preadv(ar->fd, iov, tables, index_offset) != (ssize_t) (tables*table_bytes))
+        return 0;
+
+    if(tables < 4)
+        memset(ar->orig_size, 0, table_bytes);
+
+    ar->chunks = chunks;
+
+    if(ar->version >= 9 && !read_dir(ar, index_offset + tables*table_bytes, dir_bytes)) {
+        fprintf(stderr, "%s: bad directory\n", ar->name);
+        exit(EXIT_FAILURE);
+    }
+
+    return 1;
+}
+
+// Rebuild the offset tables walking every chunk header (archives without index).
+// The chunk count comes from the header, so it is checked against the size of
+// the file before the tables are allocated. If the archive ends early it exits,
+// unless salvage is set: then the chunks found are kept and the others are
+// left with archive offset 0, which try_get_chunk_into cannot read.
+static void scan_chunks(archive ar, uint64_t chunks, int salvage) {
+    struct stat st;
+    uint64_t i, pos = ARCHIVE_HEADER_SIZE(ar->version), file_size;
+    size_t header_size = ar->version == 1 ? 3*sizeof(uint32_t) : CHUNK_FIELDS(ar->version)*sizeof(uint64_t);
+
+    if(fstat(ar->fd, &st) == -1 || (uint64_t) st.st_size < pos ||
+       chunks > ((uint64_t) st.st_size - pos) / header_size) {
+        fprintf(stderr, "%s: truncated archive\n", ar->name);
+        exit(EXIT_FAILURE);
+    }
+    file_size = st.st_size;
+
+    alloc_tables(ar, chunks);
+
+    lseek(ar->fd, pos, SEEK_SET);
+    for(i=0; i<chunks; i++) {
+        uint64_t size, chunk_num, offset, orig_size = 0, flags = 0, crc = 0;
+
+        if(ar->version == 1) {
+            uint32_t header[3];
+            if(read_full(ar->fd, header, sizeof(header)) != sizeof(header))
+                break;
+            size = header[0]; chunk_num = header[1]; offset = header[2];
+        } else {
+            uint64_t header[ARCHIVE_CHUNK_FIELDS];
+            if(read_full(ar->fd, header, header_size) != (ssize_t) header_size)
+                break;
+            size = header[0]; chunk_num = header[1]; offset = header[2];
+            if(CHUNK_FIELDS(ar->version) >= 4)
+                orig_size = header[3];
+            if(CHUNK_FIELDS(ar->version) >= 5)
+                flags = header[4];
+            if(CHUNK_FIELDS(ar->version) >= 6)
+                crc = header[5];
+        }
+        pos += header_size;
+
+        // every number below chunks must appear once, so that no entry of the tables is left empty
+        if(chunk_num >= chunks || ar->archive_offset[chunk_num] != 0) {
+            fprintf(stderr, "%s: bad chunk number %lu\n", ar->name, (unsigned long) chunk_num);
+            exit(EXIT_FAILURE);
+        }
+        if(size > file_size - pos)
+            break;
+
+        ar->archive_offset[chunk_num] = pos;
         ar->chunk_size[chunk_num]     = size;
         ar->file_offset[chunk_num]    = offset;
+        ar->orig_size[chunk_num]      = orig_size;
+        ar->flags[chunk_num]          = flags;
+        ar->crc[chunk_num]            = crc;
 
         ar->chunks++;
 
-        lseek(fd, size, SEEK_CUR);
+        pos += size;
+        lseek(ar->fd, pos, SEEK_SET);
+    }
+
+    if(i < chunks && salvage)                     // the missing chunks are found by the caller
+        ar->chunks = chunks;
+    else if(i < chunks) {                         // the numbers were all different, so only a short scan leaves gaps
+        fprintf(stderr, "%s: truncated archive\n", ar->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Read the archive header at the current position of fd
+static void read_header(int fd, char *name, int *version, uint64_t *chunks, uint32_t *codec) {
+    char magic[5];
+    uint32_t word;
+
+    *codec = 0;
+
+    if(read_full(fd, magic, 5) < 5) {
+        fprintf(stderr, "Could not read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    if(strncmp(magic, ARCHIVE_MAGIC, 5)) {
+        fprintf(stderr, "%s is not an archive file\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    if(read_full(fd, &word, sizeof(uint32_t)) < (ssize_t) sizeof(uint32_t)) {
+        fprintf(stderr, "Could not read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+
+    if(word != ARCHIVE_VERSIONED) {
+        *version = 1;
+        *chunks  = word;
+        return;
+    }
+
+    if(read_full(fd, &word, sizeof(uint32_t)) < (ssize_t) sizeof(uint32_t) ||
+       read_full(fd, chunks, sizeof(uint64_t)) < (ssize_t) sizeof(uint64_t)) {
+        fprintf(stderr, "Could not read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+    *version = word;
+    if(*version > ARCHIVE_VERSION) {
+        fprintf(stderr, "%s: unsupported archive version %d\n", name, *version);
+        exit(EXIT_FAILURE);
+    }
+    if(*chunks == ARCHIVE_INCOMPLETE) {
+        fprintf(stderr, "%s is an incomplete archive\n", name);
+        exit(EXIT_FAILURE);
+    }
+    if(*version >= 5 && read_full(fd, codec, sizeof(uint32_t)) < (ssize_t) sizeof(uint32_t)) {
+        fprintf(stderr, "Could not read %s\n", name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static archive open_file(char *filename, int salvage) {
+    int fd, version;
+    uint32_t codec;
+    uint64_t chunks;
+    archive ar;
+
+    if((fd=open(filename, O_RDWR))==-1) {
+        fprintf(stderr, "Could not open file %s: %s\n", filename, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    read_header(fd, filename, &version, &chunks, &codec);
+
+    ar = new_archive(fd, filename, version, codec);
+    ar->end = 0;
+
+    if(!read_index(ar, chunks)) {
+        if(chunks == ARCHIVE_STREAMED) {   // the writer did not get to write the footer
+            fprintf(stderr, "%s is an incomplete archive\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        scan_chunks(ar, chunks, salvage);
     }
 
     return ar;
 }
 
-void close_archive_file(archive ar) {
+archive open_archive_file(char *filename) {
+    return open_file(filename, 0);
+}
+
+archive open_archive_file_salvage(char *filename) {
+    return open_file(filename, 1);
+}
+
+archive open_archive_stream(int fd, char *name) {
+    int version;
+    uint32_t codec;
+    uint64_t chunks;
+    archive ar;
+
+    read_header(fd, name, &version, &chunks, &codec);
+
+    ar = new_archive(fd, name, version, codec);
+    ar->end    = 0;
+    ar->stream = 1;
+    ar->chunks = chunks == ARCHIVE_STREAMED ? 0 : chunks;
+
+    return ar;
+}
+
+// Write an iovec at offset, or at the current position of a stream
+static ssize_t write_at(archive ar, struct iovec *iov, int n, uint64_t offset) {
+    return ar->stream ? writev(ar->fd, iov, n) : pwritev(ar->fd, iov, n, offset);
+}
+
+// Append the end record, the index block and the footer after the last chunk,
+// then store the chunk count in the header, clearing ARCHIVE_INCOMPLETE
+// (streams keep ARCHIVE_STREAMED). Returns -1 if the archive could not be finished.
+static int write_index(archive ar) {
+    unsigned char footer[FOOTER_SIZE], *dir, *p;
+    ssize_t n;
+    size_t table_bytes = ar->chunks * sizeof(uint64_t), dir_bytes = sizeof(uint64_t);
+    uint64_t end_record[ARCHIVE_CHUNK_FIELDS] = { 0, ARCHIVE_END_CHUNK, 0, 0, 0, 0 };
+    uint64_t index_offset = ar->end + CHUNK_HEADER_SIZE;
+    struct iovec iov[9];
+
+    if(ar->files > 0)                             // dir is NULL for a single file
+        qsort(ar->dir, ar->files, sizeof(archive_file), cmp_file);
+    for(uint64_t i = 0; i < ar->files; i++)
+        dir_bytes += DIR_FIELDS*sizeof(uint64_t) + strlen(ar->dir[i].name);
+
+    dir = p = malloc(dir_bytes);
+    memcpy(p, &ar->files, sizeof(uint64_t));
+    p += sizeof(uint64_t);
+    for(uint64_t i = 0; i < ar->files; i++) {
+        archive_file *f = &ar->dir[i];
+        uint64_t fields[DIR_FIELDS] = { f->first, f->chunks, f->mode, (uint64_t) f->mtime, strlen(f->name) };
+
+        memcpy(p, fields, sizeof(fields));
+        memcpy(p + sizeof(fields), f->name, fields[4]);
+        p += sizeof(fields) + fields[4];
+    }
+
+    memcpy(footer, &index_offset, sizeof(uint64_t));
+    memcpy(footer + sizeof(uint64_t), &ar->chunks, sizeof(uint64_t));
+    memcpy(footer + 2*sizeof(uint64_t), ARCHIVE_FOOTER_MAGIC, 5);
+
+    iov[0].iov_base = end_record;
+    iov[0].iov_len  = CHUNK_HEADER_SIZE;
+    iov[1].iov_base = ar->archive_offset;
+    iov[1].iov_len  = table_bytes;
+    iov[2].iov_base = ar->file_offset;
+    iov[2].iov_len  = table_bytes;
+    iov[3].iov_base = ar->chunk_size;
+    iov[3].iov_len  = table_bytes;
+    iov[4].iov_base = ar->orig_size;
+    iov[4].iov_len  = table_bytes;
+    iov[5].iov_base = ar->flags;
+    iov[5].iov_len  = table_bytes;
+    iov[6].iov_base = ar->crc;
+    iov[6].iov_len  = table_bytes;
+    iov[7].iov_base = dir;
+    iov[7].iov_len  = dir_bytes;
+    iov[8].iov_base = footer;
+    iov[8].iov_len  = FOOTER_SIZE;
+
+    n = write_at(ar, iov, 9, ar->end);
+    if(n != (ssize_t) (CHUNK_HEADER_SIZE + 6*table_bytes + dir_bytes + FOOTER_SIZE)) {
+        fprintf(stderr, "Could not write the index of %s: %s\n", ar->name, n < 0 ? strerror(errno) : "short write");
+        free(dir);
+        return -1;
+    }
+    free(dir);
+
+    if(ar->stream)
+        return 0;
+
+    // the chunks and the index must be on disk before the archive is marked complete
+    if(fdatasync(ar->fd) == -1 ||
+       pwrite(ar->fd, &ar->chunks, sizeof(uint64_t), CHUNKS_POSITION) != sizeof(uint64_t)) {
+        fprintf(stderr, "Could not finish %s: %s\n", ar->name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int close_archive_file(archive ar) {
+    int res = 0;
+
+    if(ar->writing)
+        res = write_index(ar);
+
+    if(ar->cache)
+        cache_drop_archive(ar->cache, ar);
+
     close(ar->fd);
     free(ar->archive_offset);
     free(ar->chunk_size);
     free(ar->name);
     free(ar->file_offset);
+    free(ar->orig_size);
+    free(ar->flags);
+    free(ar->crc);
+    for(uint64_t i = 0; i < ar->files; i++)
+        free(ar->dir[i].name);
+    free(ar->dir);
     free(ar);
+    return res;
 }
 
-int add_chunk(archive ar,chunk ch) {
+// The chunk count and the offset tables are only written to disk by
+// close_archive_file
+uint64_t place_chunk(archive ar, chunk ch, uint64_t header[ARCHIVE_CHUNK_FIELDS]) {
+    uint64_t offset = ar->end;
+
     check_chunk_list_size(ar, ch->num);
 
-    lseek(ar->fd, 0, SEEK_END);
-    write(ar->fd, &ch->size, sizeof(unsigned int));
-    write(ar->fd, &ch->num, sizeof(unsigned int));
-    write(ar->fd, &ch->offset, sizeof(unsigned int));
+    header[0] = ch->size;
+    header[1] = ch->num;
+    header[2] = ch->offset;
+    header[3] = ch->orig_size;
+    header[4] = ch->flags;
+    header[5] = ch->crc;
 
-    ar->archive_offset[ch->num] = lseek(ar->fd, 0, SEEK_CUR);
+    ar->archive_offset[ch->num] = offset + CHUNK_HEADER_SIZE;
     ar->file_offset[ch->num]    = ch->offset;
-    write(ar->fd, ch->data, ch->size);
-
-    ar->chunk_size[ch->num] = ch->size;
+    ar->chunk_size[ch->num]     = ch->size;
+    ar->orig_size[ch->num]      = ch->orig_size;
+    ar->flags[ch->num]          = ch->flags;
+    ar->crc[ch->num]            = ch->crc;
     ar->chunks++;
+    ar->end += CHUNK_HEADER_SIZE + ch->size;
 
-    lseek(ar->fd, 5, SEEK_SET);
-    write(ar->fd, &ar->chunks, sizeof(unsigned int));
+    return offset;
+}
+
+// Chunks are appended at ar->end with a single positional write
+int add_chunk(archive ar,chunk ch) {
+    uint64_t header[ARCHIVE_CHUNK_FIELDS];
+    uint64_t offset = place_chunk(ar, ch, header);
+    struct iovec iov[2];
+
+    iov[0].iov_base = header;
+    iov[0].iov_len  = CHUNK_HEADER_SIZE;
+    iov[1].iov_base = ch->data;
+    iov[1].iov_len  = ch->size;
+
+    if(write_at(ar, iov, 2, offset) != (ssize_t) (CHUNK_HEADER_SIZE + ch->size)) {
+        fprintf(stderr, "Could not write chunk %lu to %s: %s\n", (unsigned long) ch->num, ar->name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
 
     return 0;
 }
 
-chunk get_chunk(archive ar, unsigned int chunk_num) {
+chunk get_chunk(archive ar, uint64_t chunk_num) {
+    return get_chunk_into(ar, chunk_num, NULL);
+}
+
+// buf (a chunk from a pool, for example) is used if its size is enough
+// for the chunk data, otherwise it is freed and a new chunk is allocated
+chunk get_chunk_into(archive ar, uint64_t chunk_num, chunk buf) {
+    chunk res = try_get_chunk_into(ar, chunk_num, buf);
+
+    if(res == NULL) {
+        fprintf(stderr, "Could not read chunk %lu from %s: %s\n", (unsigned long) chunk_num, ar->name,
+               errno ? strerror(errno) : "truncated archive");
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+chunk try_get_chunk_into(archive ar, uint64_t chunk_num, chunk buf) {
     chunk res;
 
-    res=malloc(sizeof(*res));
-    if(chunk_num > ar->chunks) {
+    if(chunk_num >= ar->chunks) {
+        if(buf) free_chunk(buf);
+        res=malloc(sizeof(*res));
         res->size   = 0;
         res->data   = NULL;
         res->num    = chunk_num;
         res->offset = -1;
+        res->orig_size = 0;
+        res->flags  = 0;
+        res->crc    = 0;
+        res->mapped = 0;
+        res->pool   = NULL;
+        res->buf_index = -1;
         return res;
     }
 
+    if(ar->archive_offset[chunk_num] == 0) {      // lost in an archive opened with open_archive_file_salvage
+        if(buf) free_chunk(buf);
+        errno = 0;
+        return NULL;
+    }
+
+    if(buf && buf->size >= ar->chunk_size[chunk_num]) {
+        res = buf;
+    } else {
+        if(buf) free_chunk(buf);
+        res = alloc_chunk(ar->chunk_size[chunk_num]);
+    }
+
     res->size   = ar->chunk_size[chunk_num];
-    res->data   = malloc(res->size);
+    res->num    = chunk_num;
     res->offset = ar->file_offset[chunk_num];
+    res->orig_size = ar->orig_size[chunk_num];
+    res->flags     = ar->flags[chunk_num];
+    res->crc       = ar->crc[chunk_num];
+
+    // positional read: the file offset of ar->fd is not shared between threads
+    for(uint64_t done = 0; done < res->size; ) {
+        ssize_t n = pread(ar->fd, res->data + done, res->size - done, ar->archive_offset[chunk_num] + done);
+        if(n <= 0) {
+            int err = n < 0 ? errno : 0;          // 0: the archive ends before the chunk
+
+            free_chunk(res);
+            errno = err;
+            return NULL;
+        }
+        done += n;
+    }
+
+    return res;
+}
+
+// Chunks of a stream are read in the order they were written. Version 6
+// archives end with an end record, older ones after the header chunk count.
+chunk next_chunk(archive ar) {
+    uint64_t bad = ARCHIVE_END_CHUNK;
+    chunk res = try_next_chunk(ar, &bad);
+
+    if(res == NULL && bad != ARCHIVE_END_CHUNK) {
+        fprintf(stderr, "%s: truncated archive\n", ar->name);
+        exit(EXIT_FAILURE);
+    }
+    return res;
+}
+
+chunk try_next_chunk(archive ar, uint64_t *bad) {
+    uint64_t header[ARCHIVE_CHUNK_FIELDS] = { 0, 0, 0, 0, 0, 0 };
+    chunk res;
 
-    lseek(ar->fd, ar->archive_offset[chunk_num], SEEK_SET);
-    read(ar->fd, res->data, res->size);
+    if(ar->version < 6 && ar->next == ar->chunks)
+        return NULL;
+
+    if(ar->version == 1) {
+        uint32_t v1_header[3];
+        if(read_full(ar->fd, v1_header, sizeof(v1_header)) != sizeof(v1_header)) {
+            *bad = ar->next;
+            return NULL;
+        }
+        header[0] = v1_header[0]; header[1] = v1_header[1]; header[2] = v1_header[2];
+    } else if(read_full(ar->fd, header, CHUNK_FIELDS(ar->version)*sizeof(uint64_t)) != (ssize_t) (CHUNK_FIELDS(ar->version)*sizeof(uint64_t))) {
+        *bad = ar->next;
+        return NULL;
+    }
+
+    if(header[1] == ARCHIVE_END_CHUNK)
+        return NULL;
+
+    res = alloc_chunk(header[0]);
+    if(read_full(ar->fd, res->data, res->size) != (ssize_t) res->size) {
+        *bad = header[1];
+        free_chunk(res);
+        return NULL;
+    }
+    res->num       = header[1];
+    res->offset    = header[2];
+    res->orig_size = header[3];
+    res->flags     = header[4];
+    res->crc       = header[5];
+
+    ar->next++;
 
     return res;
 }
 
-int chunks(archive ar) {
+uint64_t chunks(archive ar) {
     return ar->chunks;
 }
 
-chunk alloc_chunk(int size) {
+void add_archive_file(archive ar, char *name, uint64_t mode, int64_t mtime, uint64_t first, uint64_t chunks) {
+    while(*name == '/')                           // names are relative to where the files are extracted
+        name++;
+    append_file(ar, strdup(name), mode, mtime, first, chunks);
+}
+
+// Binary search in the directory, sorted by name when it is read
+archive_file *find_archive_file(archive ar, char *name) {
+    archive_file key;
+
+    while(*name == '/')
+        name++;
+    key.name = name;
+
+    return bsearch(&key, ar->dir, ar->files, sizeof(archive_file), cmp_file);
+}
+
+chunk alloc_chunk(uint64_t size) {
     chunk res;
     res       = malloc(sizeof(*res));
     res->data = malloc(size);
 
     res->size   = size;
     res->offset = 0;
+    res->file   = 0;
+    res->orig_size = 0;
+    res->flags  = 0;
+    res->crc    = 0;
+    res->mapped = 0;
+    res->pool   = NULL;
+    res->buf_index = -1;
+
+    return res;
+}
+
+chunk map_chunk(unsigned char *data, uint64_t size) {
+    chunk res;
+    res       = malloc(sizeof(*res));
+    res->data = data;
+
+    res->size   = size;
+    res->offset = 0;
+    res->file   = 0;
+    res->orig_size = 0;
+    res->flags  = 0;
+    res->crc    = 0;
+    res->mapped = 1;
+    res->pool   = NULL;
+    res->buf_index = -1;
 
     return res;
 }
 
 void free_chunk(chunk ch) {
-    free(ch->data);
+    if(ch->pool) {
+        pool_put(ch->pool, ch);
+        return;
+    }
+    if(!ch->mapped)
+        free(ch->data);
     free(ch);
 }
@@ -1,34 +1,136 @@
 #ifndef __CHUNK_ARCHIVE_H__
 #define __CHUNK_ARCHIVE_H__
 
+#include <stdint.h>
+
 // chunk is the main structure stored into the archive file
 typedef struct {
-    int size;             // size (in bytes) of the data
-    int num;              // chunk number
-    int offset;           // offset in the original file
+    uint64_t size;        // size (in bytes) of the data
+    uint64_t num;         // chunk number
+    uint64_t offset;      // offset in the original file
+    uint64_t orig_size;   // size of the data once decompressed (0 if unknown)
+    uint64_t flags;       // CHUNK_RAW if the data is stored uncompressed, CHUNK_CRC if crc is set
+    uint32_t crc;         // CRC32C of the uncompressed data (see crc32c.h)
+    uint64_t file;        // input file of the chunk when several files are compressed at once (not stored)
+    int mapped;           // data is not owned by the chunk (it points into a mapped file)
+    struct _chunk_pool *pool; // pool the chunk goes back to in free_chunk (NULL if none, see chunk_pool.h)
+    int buf_index;        // buffer of the pool registered with io_uring (-1 if none, see uring.h)
     unsigned char *data;
 } *chunk;
 
+// a file stored in a container archive. Its chunks are first to
+// first+chunks-1, and their offsets are positions in this file.
+typedef struct {
+    char *name;           // name of the file, without leading '/'
+    uint64_t mode;        // st_mode of the file
+    int64_t mtime;        // modification time (seconds since the epoch)
+    uint64_t first;       // number of its first chunk
+    uint64_t chunks;      // number of chunks
+} archive_file;
+
 // an archive is a file that stores a sequence of numbered chunks
 typedef struct {
     char *name;          // name of the file
-    unsigned int chunks;          // number of chunks
-    int *archive_offset; // offset table. archive_offset[i] is the offset in the archive where the data from chunk i starts.
-    int *file_offset;    // offset table. file_offset[i] is the offset in the uncompressed file where chunk i starts.
-    int *chunk_size;     // size table. chunk_size[i] is the size of the i chunk.
-    int table_size;      // size of archive_offset, file_offset and chunk_size
+    uint64_t chunks;          // number of chunks
+    uint64_t *archive_offset; // offset table. archive_offset[i] is the offset in the archive where the data from chunk i starts.
+    uint64_t *file_offset;    // offset table. file_offset[i] is the offset in the uncompressed file where chunk i starts.
+    uint64_t *chunk_size;     // size table. chunk_size[i] is the size of the i chunk.
+    uint64_t *orig_size;      // size table. orig_size[i] is the uncompressed size of the i chunk (0 if unknown).
+    uint64_t *flags;          // flags table. flags[i] are the CHUNK_ flags of the i chunk (0 before version 7).
+    uint64_t *crc;            // checksum table. crc[i] is the CRC32C of the uncompressed i chunk (0 before version 8).
+    uint64_t table_size;      // size of archive_offset, file_offset and chunk_size
+    uint64_t files;           // files of a container archive (0 if the archive holds a single file)
+    archive_file *dir;        // directory of a container archive, sorted by name once it is read
+    uint64_t dir_size;        // size of dir
+    uint64_t end;             // archive offset where the next chunk will be appended
+    uint64_t next;            // chunks already returned by next_chunk
     int fd;              // file descriptor
+    int version;         // on-disk format version
+    uint32_t codec;      // compression codec of the chunk data (see compress.h)
+    int container;       // the header marks the archive as a container (ARCHIVE_CONTAINER)
+    int writing;         // the archive was created for writing, the index is written on close
+    int stream;          // the archive is written or read sequentially, without seeking
+    struct _chunk_cache *cache; // cache of decompressed chunks for archive_read_range (NULL if none)
 } *archive;
 
-archive create_archive_file(char *filename); // create an archive with name filename
+// On-disk format, version 9 (all integers in host byte order):
+//   header: "CHUNK", uint32_t ARCHIVE_VERSIONED, uint32_t version, uint64_t chunks, uint32_t codec (ored with ARCHIVE_CONTAINER in a container)
+//   chunks: uint64_t size, uint64_t num, uint64_t offset, uint64_t orig_size, uint64_t flags, uint64_t crc, data
+//   end:    uint64_t 0, uint64_t ARCHIVE_END_CHUNK, uint64_t 0, uint64_t 0, uint64_t 0, uint64_t 0
+//   index:  uint64_t archive_offset[chunks], file_offset[chunks], chunk_size[chunks], orig_size[chunks], flags[chunks], crc[chunks]
+//   dir:    uint64_t files, then for every file:
+//           uint64_t first, uint64_t chunks, uint64_t mode, int64_t mtime, uint64_t name_size, name (no '\0')
+//   footer: uint64_t index_offset, uint64_t chunks, "CHIDX"
+// Chunks are only appended while writing. The header holds ARCHIVE_INCOMPLETE
+// until close_archive_file() has written the index and synced the file, so an
+// archive whose writer crashed is detected when it is opened. Archives written
+// to a pipe cannot be patched: their header holds ARCHIVE_STREAMED and the
+// chunk count is only in the footer. The end record lets a reader that cannot
+// seek find the last chunk. The directory lists the files of a container
+// archive by name (files is 0 for an archive of a single file); the
+// offsets of the chunks of each file start at 0. Version 8 has no
+// directory, version 7 has no checksums, version 6 has no chunk flags (every chunk is
+// compressed), version 5 has no end record, versions 2 to 4 have no codec in
+// the header (their chunks are zlib streams), versions 2 and 3 lack orig_size
+// in the chunk headers and the index, and version 2 has no incomplete marker.
+// Version 1 archives have a "CHUNK", uint32_t chunks header, 32 bit chunk
+// headers and index entries, and may lack the index block, in which case
+// they are read by scanning the chunk headers.
+#define ARCHIVE_MAGIC        "CHUNK"
+#define ARCHIVE_VERSIONED    0xffffffffU  // stored where version 1 keeps the chunk count
+#define ARCHIVE_VERSION      9
+#define ARCHIVE_CHUNK_FIELDS 6              // uint64_t fields of a chunk header
+#define ARCHIVE_INCOMPLETE   UINT64_MAX     // chunk count of an archive that was not closed
+#define ARCHIVE_STREAMED     (UINT64_MAX-1) // chunk count of an archive written sequentially
+#define ARCHIVE_END_CHUNK    UINT64_MAX     // chunk number of the end record
+#define ARCHIVE_FOOTER_MAGIC "CHIDX"
+#define ARCHIVE_CONTAINER    0x10000U       // flag in the codec word of the header of a container, which
+                                            // has to be read with its directory, not from a pipe
+
+#define CHUNK_RAW 1   // the chunk did not shrink when compressed, its data is stored as is
+#define CHUNK_CRC 2   // crc holds the CRC32C of the uncompressed data
+
+archive create_archive_file(char *filename, uint32_t codec); // create an archive with name filename (codec | ARCHIVE_CONTAINER for a container)
 archive open_archive_file(char *filename);   // open an existing archive
-void    close_archive_file(archive ar);      // close an archive
+// Open an archive to check it. An archive without index that ends early
+// keeps the chunk count of its header, and the chunks that were cut off
+// cannot be read with try_get_chunk_into.
+archive open_archive_file_salvage(char *filename);
+int     close_archive_file(archive ar);      // close an archive, -1 if its index could not be written
+
+// Archives on a file descriptor that may not be seekable (pipes). Streams
+// opened for reading only support next_chunk.
+archive create_archive_stream(int fd, char *name, uint32_t codec);
+archive open_archive_stream(int fd, char *name);
+
+// get_chunk and get_chunk_into use positional reads and do not move the
+// file offset, so several threads can read chunks of the same archive at
+// once. add_chunk, next_chunk and close_archive_file must not run
+// concurrently with any other call on the archive.
+int      add_chunk(archive ar, chunk ch);          // add a chunk to a file
+// Reserve the place of ch after the last chunk and record it in the index
+// without writing it. header is filled with the chunk header; the caller
+// writes it followed by the data at the returned offset.
+uint64_t place_chunk(archive ar, chunk ch, uint64_t header[ARCHIVE_CHUNK_FIELDS]);
+chunk    get_chunk(archive ar, uint64_t chunk_num); // get a chunk from a file
+chunk    get_chunk_into(archive ar, uint64_t chunk_num, chunk buf); // get a chunk using the buffer of buf if it is big enough
+chunk    next_chunk(archive ar);                   // next chunk in archive order, NULL after the last one
+// get_chunk_into and next_chunk exit when the archive is truncated or cannot
+// be read. These return NULL instead (buf is released); try_next_chunk sets
+// *bad to the number of the chunk it could not read, or to the number of
+// chunks read before it if its header is cut short, and leaves it as is at
+// the end of the archive.
+chunk    try_get_chunk_into(archive ar, uint64_t chunk_num, chunk buf);
+chunk    try_next_chunk(archive ar, uint64_t *bad);
+uint64_t chunks(archive ar);                       // number of chunks the ar archive
 
-int   add_chunk(archive ar, chunk ch);          // add a chunk to a file
-chunk get_chunk(archive ar, unsigned int chunk_num);    // get a chunk from a file
-int   chunks(archive ar);                      // number of chunks the ar archive
+// Directory of container archives. add_archive_file records a file whose
+// chunks have been (or will be) added, it is written by close_archive_file.
+void          add_archive_file(archive ar, char *name, uint64_t mode, int64_t mtime, uint64_t first, uint64_t chunks);
+archive_file *find_archive_file(archive ar, char *name);  // file of the directory, NULL if there is none with that name
 
-chunk alloc_chunk(int size);  // Allocate a new chunk
-void  free_chunk(chunk ch);   // Free the memory used by a chunk
+chunk alloc_chunk(uint64_t size);  // Allocate a new chunk
+chunk map_chunk(unsigned char *data, uint64_t size); // New chunk pointing to data, which free_chunk does not release
+void  free_chunk(chunk ch);        // Free the memory used by a chunk, or return it to its pool
 
 #endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "chunk_cache.h"
+
+#define CACHE_BUCKETS 1024
+
+// entries are in a hash table of chains for lookups and in a doubly
+// linked list from the most (head) to the least (tail) recently used
+typedef struct entry {
+    archive ar;
+    chunk ch;
+    struct entry *next_hash;
+    struct entry *prev, *next;
+} entry;
+
+typedef struct _chunk_cache {
+    pthread_mutex_t mutex;
+    uint64_t budget;
+    uint64_t bytes;
+    uint64_t hits, misses;
+    uint64_t entries;
+    uint64_t buckets;
+    entry **table;
+    entry *head, *tail;
+} _chunk_cache;
+
+static uint64_t hash(archive ar, uint64_t num, uint64_t buckets) {
+    uint64_t h = (uintptr_t) ar ^ (num * 0x9e3779b97f4a7c15ULL);
+
+    h ^= h >> 29;
+    return h % buckets;
+}
+
+chunk_cache cache_create(uint64_t budget) {
+    chunk_cache c = malloc(sizeof(_chunk_cache));
+    if (c == NULL) {
+        perror("Error allocating memory for chunk cache");
+        exit(EXIT_FAILURE);
+    }
+
+    c->budget  = budget;
+    c->bytes   = 0;
+    c->hits    = 0;
+    c->misses  = 0;
+    c->entries = 0;
+    c->buckets = CACHE_BUCKETS;
+    c->table   = calloc(c->buckets, sizeof(entry *));
+    c->head    = NULL;
+    c->tail    = NULL;
+    if (c->table == NULL) {
+        perror("Error allocating memory for chunk cache");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_mutex_init(&c->mutex, NULL) != 0) {
+        perror("Error initializing mutex");
+        exit(EXIT_FAILURE);
+    }
+
+    return c;
+}
+
+static entry **find(chunk_cache c, archive ar, uint64_t num) {
+    entry **e = &c->table[hash(ar, num, c->buckets)];
+
+    while (*e && ((*e)->ar != ar || (*e)->ch->num != num))
+        e = &(*e)->next_hash;
+
+    return e;
+}
+
+static void unlink_lru(chunk_cache c, entry *e) {
+    if (e->prev) e->prev->next = e->next; else c->head = e->next;
+    if (e->next) e->next->prev = e->prev; else c->tail = e->prev;
+}
+
+static void push_lru(chunk_cache c, entry *e) {
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) c->head->prev = e; else c->tail = e;
+    c->head = e;
+}
+
+static void evict(chunk_cache c, entry *e) {
+    entry **slot = find(c, e->ar, e->ch->num);
+
+    *slot = e->next_hash;
+    unlink_lru(c, e);
+    c->bytes -= e->ch->size;
+    c->entries--;
+    free_chunk(e->ch);
+    free(e);
+}
+
+// Double the buckets when the chains get longer than two entries on average
+static void grow(chunk_cache c) {
+    uint64_t buckets = 2 * c->buckets;
+    entry **table = calloc(buckets, sizeof(entry *));
+
+    if (table == NULL)
+        return;
+
+    for (entry *e = c->head; e; e = e->next) {
+        uint64_t h = hash(e->ar, e->ch->num, buckets);
+        e->next_hash = table[h];
+        table[h] = e;
+    }
+
+    free(c->table);
+    c->table   = table;
+    c->buckets = buckets;
+}
+
+int64_t cache_read(chunk_cache c, archive ar, uint64_t num, uint64_t from, uint64_t len, unsigned char *buf) {
+    entry *e;
+    int64_t n = -1;
+
+    pthread_mutex_lock(&c->mutex);
+
+    e = *find(c, ar, num);
+    if (e) {
+        c->hits++;
+        unlink_lru(c, e);
+        push_lru(c, e);
+
+        n = 0;
+        if (from < e->ch->size) {
+            n = e->ch->size - from < len ? e->ch->size - from : len;
+            memcpy(buf, e->ch->data + from, n);
+        }
+    } else {
+        c->misses++;
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+
+    return n;
+}
+
+void cache_insert(chunk_cache c, archive ar, chunk ch) {
+    entry **slot, *e;
+
+    if (ch->size > c->budget) {
+        free_chunk(ch);
+        return;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+
+    slot = find(c, ar, ch->num);
+    if (*slot) {                 // another thread inserted it first
+        pthread_mutex_unlock(&c->mutex);
+        free_chunk(ch);
+        return;
+    }
+
+    while (c->tail && c->bytes + ch->size > c->budget)
+        evict(c, c->tail);
+
+    e = malloc(sizeof(entry));
+    e->ar = ar;
+    e->ch = ch;
+    e->next_hash = NULL;
+    *find(c, ar, ch->num) = e;   // the slot may have moved with the evictions
+    push_lru(c, e);
+    c->bytes += ch->size;
+    c->entries++;
+
+    if (c->entries > 2 * c->buckets)
+        grow(c);
+
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void cache_drop_archive(chunk_cache c, archive ar) {
+    pthread_mutex_lock(&c->mutex);
+
+    for (entry *e = c->head, *next; e; e = next) {
+        next = e->next;
+        if (e->ar == ar)
+            evict(c, e);
+    }
+
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void cache_stats(chunk_cache c, uint64_t *hits, uint64_t *misses, uint64_t *bytes) {
+    pthread_mutex_lock(&c->mutex);
+    if (hits)   *hits   = c->hits;
+    if (misses) *misses = c->misses;
+    if (bytes)  *bytes  = c->bytes;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void cache_destroy(chunk_cache c) {
+    while (c->tail)
+        evict(c, c->tail);
+
+    pthread_mutex_destroy(&c->mutex);
+    free(c->table);
+    free(c);
+}
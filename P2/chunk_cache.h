@@ -0,0 +1,28 @@
+#ifndef __CHUNK_CACHE_H__
+#define __CHUNK_CACHE_H__
+
+#include "chunk_archive.h"
+
+// LRU cache of decompressed chunks, keyed by archive and chunk number. It
+// holds chunks up to a budget of bytes of decompressed data, evicting the
+// least recently used ones. It can be shared between threads and archives.
+// An archive uses a cache for archive_read_range once it is attached with
+// archive_set_cache (see extract.h); its chunks are dropped when it is closed.
+typedef struct _chunk_cache *chunk_cache;
+
+chunk_cache cache_create(uint64_t budget);  // Cache of up to budget bytes
+void        cache_destroy(chunk_cache c);   // Release the cache and its chunks
+
+// Copy up to len bytes starting at offset from of the decompressed chunk num
+// of ar into buf. Returns the number of bytes copied, or -1 if the chunk is
+// not in the cache.
+int64_t cache_read(chunk_cache c, archive ar, uint64_t num, uint64_t from, uint64_t len, unsigned char *buf);
+
+// Add the decompressed chunk ch of ar. The cache owns ch from then on: it is
+// freed when evicted, or right away if it is bigger than the budget.
+void cache_insert(chunk_cache c, archive ar, chunk ch);
+
+void cache_drop_archive(chunk_cache c, archive ar);  // Evict every chunk of ar
+void cache_stats(chunk_cache c, uint64_t *hits, uint64_t *misses, uint64_t *bytes);
+
+#endif
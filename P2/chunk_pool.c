@@ -0,0 +1,121 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "chunk_pool.h"
+
+// free chunks are kept in a stack, the most recently used buffer is
+// handed out first while its pages are still in the cache
+typedef struct _chunk_pool {
+    pthread_mutex_t mutex;
+    uint64_t size;
+    int max;
+    int free;
+    int fixed;                    // only the chunks of pool_buffers are kept
+    chunk *chunks;
+} _chunk_pool;
+
+chunk_pool pool_create(int max, uint64_t size) {
+    chunk_pool p = malloc(sizeof(_chunk_pool));
+    if (p == NULL) {
+        perror("Error allocating memory for chunk pool");
+        exit(EXIT_FAILURE);
+    }
+
+    p->size = size;
+    p->max = max;
+    p->free = 0;
+    p->fixed = 0;
+    p->chunks = malloc(max * sizeof(chunk));
+    if (p->chunks == NULL) {
+        perror("Error allocating memory for chunk pool");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_mutex_init(&p->mutex, NULL) != 0) {
+        perror("Error initializing mutex");
+        exit(EXIT_FAILURE);
+    }
+
+    return p;
+}
+
+// A pool never makes the caller wait: when it is empty a new chunk is
+// allocated, and it joins the pool when it is freed if there is room
+chunk pool_get(chunk_pool p) {
+    chunk ch = NULL;
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->free > 0)
+        ch = p->chunks[--p->free];
+    pthread_mutex_unlock(&p->mutex);
+
+    if (ch == NULL) {
+        ch = alloc_chunk(p->size);
+        ch->pool = p;
+    }
+
+    ch->size      = p->size;
+    ch->num       = 0;
+    ch->offset    = 0;
+    ch->file      = 0;
+    ch->orig_size = 0;
+    ch->flags     = 0;
+    ch->crc       = 0;
+    ch->mapped    = 0;                            // a recycled chunk keeps nothing of its last use
+
+    return ch;
+}
+
+void pool_put(chunk_pool p, chunk ch) {
+    pthread_mutex_lock(&p->mutex);
+    if (p->free < p->max && (!p->fixed || ch->buf_index >= 0)) {
+        p->chunks[p->free++] = ch;
+        ch = NULL;
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    if (ch != NULL) {
+        free(ch->data);
+        free(ch);
+    }
+}
+
+uint64_t pool_chunk_size(chunk_pool p) {
+    return p->size;
+}
+
+struct iovec *pool_buffers(chunk_pool p, int *n) {
+    struct iovec *iov = malloc(p->max * sizeof(struct iovec));
+    if (iov == NULL) {
+        perror("Error allocating memory for chunk pool");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    for (int i = 0; i < p->max; i++) {
+        chunk ch = alloc_chunk(p->size);
+
+        ch->pool      = p;
+        ch->buf_index = i;
+        p->chunks[i]  = ch;
+        iov[i].iov_base = ch->data;
+        iov[i].iov_len  = p->size;
+    }
+    p->free  = p->max;
+    p->fixed = 1;
+    pthread_mutex_unlock(&p->mutex);
+
+    *n = p->max;
+
+    return iov;
+}
+
+void pool_destroy(chunk_pool p) {
+    for (int i = 0; i < p->free; i++) {
+        free(p->chunks[i]->data);
+        free(p->chunks[i]);
+    }
+    pthread_mutex_destroy(&p->mutex);
+    free(p->chunks);
+    free(p);
+}
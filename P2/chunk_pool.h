@@ -0,0 +1,27 @@
+#ifndef __CHUNK_POOL_H__
+#define __CHUNK_POOL_H__
+
+#include <sys/uio.h>
+#include "chunk_archive.h"
+
+// A pool keeps up to max chunks with buffers of the same size for reuse, so a
+// pipeline that is running does not allocate memory for every chunk. Buffers
+// are allocated the first time they are needed. free_chunk() returns a chunk
+// to its pool, or releases it if the pool already holds max free chunks.
+// Pools can be shared between threads.
+typedef struct _chunk_pool *chunk_pool;
+
+chunk_pool pool_create(int max, uint64_t size); // Pool of chunks with buffers of size bytes
+chunk      pool_get(chunk_pool p);              // A free chunk of the pool (size is the buffer size), never waits
+void       pool_put(chunk_pool p, chunk ch);    // Return a chunk to the pool, used by free_chunk
+uint64_t   pool_chunk_size(chunk_pool p);       // Size of the buffers of the pool
+
+// Allocate the max chunks of the pool at once, before the first pool_get, and
+// return their buffers for uring_register_buffers (the caller frees the
+// array, n is set to max). Each chunk keeps its position in buf_index, and
+// from then on the pool only holds these chunks: the ones allocated when it
+// is empty are freed.
+struct iovec *pool_buffers(chunk_pool p, int *n);
+void       pool_destroy(chunk_pool p);          // Release the pool and its free chunks
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __CODEC_H__
+#define __CODEC_H__
+
+#include "chunk_archive.h"
+
+// A codec backend. The state returned by create belongs to one thread and is
+// passed to every other call, so backends can keep their streams between chunks.
+// create gets a level between min_level and max_level and a zlib strategy,
+// which other backends ignore.
+// compress and decompress write to a buffer of out_size bytes (at least bound()
+// bytes when compressing) and return the size of the output. decompress
+// returns CODEC_ERROR if the data is malformed or does not fit in out_size.
+#define CODEC_ERROR UINT64_MAX
+
+typedef struct {
+    char *name;
+    int min_level, max_level, default_level;
+    void    *(*create)(int level, int strategy);
+    void     (*destroy)(void *state);
+    uint64_t (*bound)(void *state, uint64_t size);
+    uint64_t (*compress)(void *state, chunk ch, unsigned char *out, uint64_t out_size);
+    uint64_t (*decompress)(void *state, chunk ch, unsigned char *out, uint64_t out_size);
+} codec;
+
+#ifdef HAVE_ZSTD
+extern codec zstd_codec;
+#endif
+
+#ifdef HAVE_LZ4
+extern codec lz4_codec;
+#endif
+
+#endif
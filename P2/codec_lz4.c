@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <lz4.h>
+#include "codec.h"
+
+// The state is the LZ4 compression state, reused through LZ4_compress_fast_extState.
+// LZ4 has a single level.
+static void *lz4_create(int level, int strategy) {
+    return malloc(LZ4_sizeofState());
+}
+
+static void lz4_destroy(void *state) {
+    free(state);
+}
+
+static uint64_t lz4_bound(void *state, uint64_t size) {
+    return LZ4_compressBound(size);
+}
+
+static uint64_t lz4_compress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    int res;
+
+    res = LZ4_compress_fast_extState(state, (char *) ch->data, (char *) out, ch->size, out_size, 1);
+    if(res <= 0) {
+        fprintf(stderr, "Error compressing data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return res;
+}
+
+static uint64_t lz4_decompress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    int res;
+
+    res = LZ4_decompress_safe((char *) ch->data, (char *) out, ch->size, out_size);
+    if(res < 0)
+        return CODEC_ERROR;
+
+    return res;
+}
+
+codec lz4_codec = {
+    .name          = "lz4",
+    .min_level     = 1,
+    .max_level     = 1,
+    .default_level = 1,
+    .create        = lz4_create,
+    .destroy       = lz4_destroy,
+    .bound         = lz4_bound,
+    .compress      = lz4_compress,
+    .decompress    = lz4_decompress,
+};
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <zstd.h>
+#include "codec.h"
+
+typedef struct {
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    int level;
+} zstd_state;
+
+static void *zstd_create(int level, int strategy) {
+    zstd_state *st = calloc(1, sizeof(zstd_state));
+
+    st->level = level;
+
+    return st;
+}
+
+static void zstd_destroy(void *state) {
+    zstd_state *st = state;
+
+    ZSTD_freeCCtx(st->cctx);
+    ZSTD_freeDCtx(st->dctx);
+    free(st);
+}
+
+static uint64_t zstd_bound(void *state, uint64_t size) {
+    return ZSTD_compressBound(size);
+}
+
+static uint64_t zstd_compress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    zstd_state *st = state;
+    size_t res;
+
+    if(st->cctx == NULL && (st->cctx = ZSTD_createCCtx()) == NULL) {
+        fprintf(stderr, "Could not initialize zstd\n");
+        exit(EXIT_FAILURE);
+    }
+
+    res = ZSTD_compressCCtx(st->cctx, out, out_size, ch->data, ch->size, st->level);
+    if(ZSTD_isError(res)) {
+        fprintf(stderr, "Error compressing data: %s\n", ZSTD_getErrorName(res));
+        exit(EXIT_FAILURE);
+    }
+
+    return res;
+}
+
+static uint64_t zstd_decompress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    zstd_state *st = state;
+    size_t res;
+
+    if(st->dctx == NULL && (st->dctx = ZSTD_createDCtx()) == NULL) {
+        fprintf(stderr, "Could not initialize zstd\n");
+        exit(EXIT_FAILURE);
+    }
+
+    res = ZSTD_decompressDCtx(st->dctx, out, out_size, ch->data, ch->size);
+    if(ZSTD_isError(res))
+        return CODEC_ERROR;
+
+    return res;
+}
+
+codec zstd_codec = {
+    .name          = "zstd",
+    .min_level     = 1,
+    .max_level     = 19,
+    .default_level = 3,
+    .create        = zstd_create,
+    .destroy       = zstd_destroy,
+    .bound         = zstd_bound,
+    .compress      = zstd_compress,
+    .decompress    = zstd_decompress,
+};
@@ -92,7 +92,7 @@ void comp(struct options opt) {
         strncat(comp_file, ".ch", 255);
     }
 
-    ar = create_archive_file(comp_file);
+    ar = create_archive_file(comp_file, CODEC_ZLIB);
 
     in  = q_create(opt.queue_size);
     out = q_create(opt.queue_size);
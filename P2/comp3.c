@@ -1,6 +1,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <dirent.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
@@ -8,257 +10,1762 @@
 #include <errno.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 #include "compress.h"
+#include "crc32c.h"
 #include "chunk_archive.h"
+#include "chunk_pool.h"
+#include "extract.h"
 #include "queue.h"
+#include "task_pool.h"
+#include "uring.h"
 #include "options.h"
 
 #define CHUNK_SIZE (1024*1024)
 #define QUEUE_SIZE 20
 
-#define COMPRESS 1
-#define DECOMPRESS 0
+#define BENCH_SAMPLE (64*1024*1024)
 
-typedef struct{                                   //struct para worker
-    queue in;
-    queue out;
-    chunk (*process)(chunk);
-    sem_t * sem_remaining_chunks;           
-    sem_t * q_in_available_chunks;
-    sem_t * q_out_available_chunks;               //semáforos para disponibilidad de chunks
-    sem_t * q_in_free_spaces;                     //semáforos para controlar espacio libre 
-    sem_t * q_out_free_spaces;
-}workerargs;
+#define RANGE_BUFFER (16*1024*1024)
+
+#define BATCH 8                                   //máximo de fragmentos que se mueven de una vez por las colas
+
+#define FILE_END UINT64_MAX                       //número del aviso de fin de un fichero de entrada en la cola de salida
+
+#define IO_DEPTH 16                               //lecturas o escrituras en vuelo con io_uring
+
+#define AUTO_MIN_SIZE (64*1024)                   //límites del tamaño de fragmento con --auto-size
+#define AUTO_MAX_SIZE (4*1024*1024)
+#define AUTO_TARGET 0.05                          //segundos de CPU de compresión por fragmento con --auto-size
+
+typedef struct{                                   //medidas para el tamaño de fragmento adaptativo (--auto-size)
+    pthread_mutex_t mutex;
+    double time_per_byte;                         //media móvil del tiempo de compresión por byte
+    double ratio;                                 //media móvil del tamaño comprimido / original
+    uint64_t samples;
+    uint64_t start;                               //tamaño de los fragmentos hasta tener medidas
+    int threads;
+}autosize;
+
+typedef struct{                                   //fragmento dañado encontrado con --test
+    uint64_t num;
+    int status;                                   //ZCHECK_ (ver compress.h)
+}bad_chunk;
+
+typedef struct{                                   //resultados de --test
+    archive ar;
+    chunk_pool out_pool;                          //buffers para los fragmentos descomprimidos (NULL si no se conoce su tamaño)
+    pthread_mutex_t mutex;                        //protege los contadores y la lista de dañados
+    uint64_t checked;                             //fragmentos comprobados
+    uint64_t bytes;                               //bytes descomprimidos
+    bad_chunk *bad;
+    uint64_t bad_count, bad_size;
+}testargs;
+
+typedef struct{                                   //compresión o descompresión repartida en el pool de threads
+    task_pool pool;
+    queue out;                                    //cola de resultados para el writer, recibe un NULL al terminar
+    chunk (*process)(zcontext, chunk, chunk);    //el tercer argumento es el buffer para el resultado
+    testargs *test;                               //con --test los fragmentos se comprueban (process y out no se usan)
+    chunk_pool out_pool;                          //buffers para los resultados (NULL si se reservan con malloc)
+    int codec;                                    //codec de compresión del archivo
+    int level, strategy;                          //nivel y estrategia de compresión
+    int batch;                                    //fragmentos de cada tarea
+    autosize *sizer;                              //se anota el tiempo y el ratio de cada fragmento (NULL si no)
+    zcontext *ctx;                                //estado del codec de cada thread del pool, se crea al usarlo
+    sem_t slots;                                  //fragmentos enviados y no terminados, limita la memoria
+    int pending;                                  //tareas sin terminar, más una hasta el final de la entrada
+    sem_t done;
+}job;
+
+typedef struct{                                   //tarea del pool: un lote de fragmentos de un job
+    job *job;
+    int n;
+    chunk chunks[BATCH];
+}task;
+
+typedef struct io_request{                        //lectura o escritura en vuelo con io_uring
+    chunk ch;
+    int fd;                                       //fichero de la escritura
+    uint64_t pos;                                 //posición en el fichero
+    uint64_t header[ARCHIVE_CHUNK_FIELDS];        //cabecera del fragmento si se escribe en el archivo
+    struct iovec iov[2];
+    int niov;
+    struct io_request *next;                      //siguiente libre
+}io_request;
+
+typedef struct{                                   //ventana de reordenación para escribir en orden
+    chunk *slots;                                 //fragmentos pendientes, indexados por num % window
+    uint64_t window;
+    uint64_t next;                                //siguiente fragmento a escribir
+    sem_t free_slots;                             //el lector no se adelanta más de window fragmentos
+}reorder;
+
+typedef struct{                                   //fichero de entrada de comp y su archivo
+    char *name;
+    unsigned char *map;                           //fichero mapeado en memoria (NULL si se lee con read o io_uring)
+    uint64_t size;                                //tamaño del fichero (UINT64_MAX si no se conoce)
+    archive ar;                                   //NULL si el fichero no se ha podido abrir
+    uint64_t mode;                                //st_mode y st_mtime para el directorio con --container
+    int64_t mtime;
+    uint64_t first;                               //número en el pipeline de su primer fragmento
+    uint64_t chunks;                              //fragmentos, el reader lo anota antes de avisar del final
+    uint64_t written;                             //fragmentos añadidos al archivo por el writer
+    int read;                                     //el writer ha recibido el aviso del final
+}input_file;
 
 typedef struct{                                   //struct para reader
-    queue in;
-    sem_t *q_in_available_chunks;
-    sem_t *q_in_free_spaces;
+    job *job;
     struct options opt;
-    int fd, chunks;
+    input_file *files;                            //los fragmentos de todos los ficheros van al mismo job
+    int nfiles;
+    uint64_t seq;                                 //número del siguiente fragmento, sigue de un fichero a otro
+    input_file *file;                             //fichero que se está leyendo
+    archive container;                            //archivo de todos los ficheros con --container (NULL si no)
+    int fd;
+    unsigned char *map;                           //fichero de entrada mapeado en memoria (NULL si se usa read)
+    uint64_t size;                                //tamaño del fichero (UINT64_MAX si no se conoce)
+    uint64_t offset;                              //siguiente posición a leer con io_uring
+    chunk_pool pool;                              //buffers para los fragmentos leídos con read
+    reorder *order;                               //ventana del writer si el archivo se escribe en orden
+    uring ring;                                   //lecturas con io_uring (NULL si se usa read)
+    autosize *sizer;                              //tamaño de cada fragmento con --auto-size (NULL si es opt.size)
 }readerargs;
 
 typedef struct{                                   //struct para writer
-    int fd, chunks;
-    sem_t *q_out_available_chunks;
-    sem_t *q_out_free_spaces;
-    queue out;
-    archive ar;
+    int fd;
+    queue out;                                    //termina con el NULL del job
+    archive ar;                                   //en comp, el archivo de --container (NULL si no)
+    input_file *files;                            //archivos de comp, el de cada fragmento es files[ch->file]
+    reorder *order;                               //NULL si se escribe cada fragmento en su offset
+    uring ring;                                   //escrituras con io_uring (NULL si se usa write)
+    io_request io[IO_DEPTH];
+    io_request *free_io;                          //peticiones libres para el ring
+    int failed;                                   //algún archivo de comp no se pudo terminar
 }writerargs;
 
-// take chunks from queue in, run them through process (compress or decompress), send them to queue out
-void *worker(void * arg) {
-    chunk ch, res;
-    workerargs *args = arg;
+typedef struct{                                   //struct para el lector del archivo comprimido
+    job *job;
+    archive ar;
+    uint64_t first, last;                         //fragmentos que se leen (last no se lee; no se usan en una tubería)
+    reorder *order;
+    chunk_pool pool;                              //buffers para los fragmentos comprimidos (NULL si no se conoce su tamaño)
+    uring ring;                                   //lecturas con io_uring (NULL si se usa pread)
+}archivereaderargs;
 
-    while(sem_trywait(args->sem_remaining_chunks) == 0){ //intenta bloquear el semáforo, devuelve 0 si lo consigue
-      
-        sem_wait(args->q_in_available_chunks);    //espera que haya espacio disponible en cola de entrada
-        ch = q_remove(args->in);                  //coge fragmentos cola de entrada
-        sem_post(args->q_in_free_spaces);         //libera espacio en cola de entrada
+static double now(void) {
+    struct timespec ts;
 
-        res = (args->process)(ch);                //comprimir/descomprimir
-        free_chunk(ch);                           //libera memoria del fragmento que quitamos de la cola de entrada
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU time of the calling thread, it does not count the time other threads
+// run on the same core
+static double thread_time(void) {
+    struct timespec ts;
 
-        sem_wait(args->q_out_free_spaces);        //espera a que haya espacio disponible en cola de salida
-        q_insert(args->out, res);                 //inserta resultado a cola de salida
-        sem_post(args->q_out_available_chunks);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static autosize *autosize_create(uint64_t start, int threads) {
+    autosize *a = malloc(sizeof(autosize));
+
+    pthread_mutex_init(&a->mutex, NULL);
+    a->time_per_byte = 0;
+    a->ratio         = 1;
+    a->samples       = 0;
+    a->start         = start < AUTO_MIN_SIZE ? AUTO_MIN_SIZE : start > AUTO_MAX_SIZE ? AUTO_MAX_SIZE : start;
+    a->threads       = threads;
+
+    return a;
+}
+
+static void autosize_destroy(autosize *a) {
+    pthread_mutex_destroy(&a->mutex);
+    free(a);
+}
+
+// A worker compressed in bytes to out bytes in the given seconds. The last
+// chunk of the file can be tiny, and chunks below the minimum are not measured.
+static void autosize_record(autosize *a, uint64_t in, uint64_t out, double seconds) {
+    if(in < AUTO_MIN_SIZE)
+        return;
+
+    pthread_mutex_lock(&a->mutex);
+    if(a->samples++ == 0) {
+        a->time_per_byte = seconds / in;
+        a->ratio         = (double) out / in;
+    } else {
+        a->time_per_byte = 0.8*a->time_per_byte + 0.2*seconds / in;
+        a->ratio         = 0.8*a->ratio + 0.2*(double) out / in;
     }
-    
+    pthread_mutex_unlock(&a->mutex);
+}
 
-    return NULL;
+// Size of the next chunk, with remaining bytes left in the input (UINT64_MAX
+// if not known). Each chunk should take AUTO_TARGET seconds to compress, so
+// the queues move few chunks, and up to twice as long if the data compresses
+// well, since bigger chunks then give a better ratio. Near the end of the file
+// the rest is split among the workers so all of them have work.
+static uint64_t autosize_next(autosize *a, uint64_t remaining) {
+    double size;
+
+    pthread_mutex_lock(&a->mutex);
+    if(a->samples == 0 || a->time_per_byte <= 0)
+        size = a->start;
+    else
+        size = AUTO_TARGET * (2 - (a->ratio < 1 ? a->ratio : 1)) / a->time_per_byte;
+    pthread_mutex_unlock(&a->mutex);
+
+    if(remaining != UINT64_MAX && size > remaining / (2*a->threads))
+        size = remaining / (2*a->threads);
+
+    if(size < AUTO_MIN_SIZE) size = AUTO_MIN_SIZE;
+    if(size > AUTO_MAX_SIZE) size = AUTO_MAX_SIZE;
+
+    return (uint64_t) size & ~(uint64_t) 4095;    //múltiplo de la página, los fragmentos mapeados empiezan en una página
+}
+
+static reorder *reorder_create(uint64_t window) {
+    reorder *r = malloc(sizeof(reorder));
+
+    r->slots  = calloc(window, sizeof(chunk));
+    r->window = window;
+    r->next   = 0;
+    sem_init(&r->free_slots, 0, window);
+
+    return r;
+}
+
+static void reorder_destroy(reorder *r) {
+    sem_destroy(&r->free_slots);
+    free(r->slots);
+    free(r);
+}
+
+// Double the window, moving every pending chunk to its new slot
+static void reorder_grow(reorder *r) {
+    chunk *slots = calloc(2*r->window, sizeof(chunk));
+
+    for(uint64_t i = 0; i < r->window; i++)
+        if(r->slots[i])
+            slots[r->slots[i]->num % (2*r->window)] = r->slots[i];
+
+    free(r->slots);
+    r->slots   = slots;
+    r->window *= 2;
+}
+
+// Store ch in the window and pass every chunk that is now in sequence to emit.
+// Producers that send chunks in chunk order wait on free_slots before sending
+// one, so at most window chunks are pending and each one has its own slot.
+// Chunks read from a stream come in archive order and may be further apart,
+// then the window grows.
+static void reorder_put(reorder *r, chunk ch, void (*emit)(void *, chunk), void *arg) {
+    while(ch->num - r->next >= r->window)
+        reorder_grow(r);
+    r->slots[ch->num % r->window] = ch;
+
+    while((ch = r->slots[r->next % r->window]) != NULL && ch->num == r->next) {
+        r->slots[r->next % r->window] = NULL;
+        r->next++;
+        emit(arg, ch);
+        sem_post(&r->free_slots);
+    }
+}
+
+static void job_submit(job *j, chunk *batch, int n);
+static void job_release(job *j);
+
+// Wait until the writer has room for one more chunk in the reorder window.
+// The chunks in batch are sent first, the writer may be waiting for them.
+static void wait_window(reorder *order, job *j, chunk *batch, int *n) {
+    if(sem_trywait(&order->free_slots) == 0)
+        return;
+
+    job_submit(j, batch, *n);
+    *n = 0;
+    sem_wait(&order->free_slots);
+}
+
+// Send the chunks left in batch; the job ends when its tasks are done
+static void end_of_input(job *j, chunk *batch, int n) {
+    job_submit(j, batch, n);
+    job_release(j);
+}
+
+// Largest number of chunks in the pipeline at the same time: the chunks sent
+// to the pool (job_slots), the out queue full, and a batch held by the reader
+// and the writer
+static int pipeline_chunks(struct options opt) {
+    return 2*opt.queue_size + (opt.num_threads + 2)*BATCH;
+}
+
+// Chunks in a task: with small queues every thread still gets work
+static int worker_batch(struct options opt) {
+    int batch = opt.queue_size / opt.num_threads;
+
+    return batch < 1 ? 1 : batch > BATCH ? BATCH : batch;
+}
+
+// Write n bytes to a file that may be a pipe
+static void write_full(int fd, unsigned char *buf, uint64_t n) {
+    ssize_t w;
+
+    while(n > 0) {
+        if((w = write(fd, buf, n)) < 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf += w;
+        n   -= w;
+    }
 }
 
-void * reader(void *arg){                         //lee datos del archivo y los coloca en la cola
-    int offset = 0;                               //posición actual del archivo
+// Write n bytes at offset of a file
+static void pwrite_full(int fd, unsigned char *buf, uint64_t n, uint64_t offset) {
+    ssize_t w;
+
+    while(n > 0) {
+        if((w = pwrite(fd, buf, n, offset)) < 0) {
+            fprintf(stderr, "Error writing output: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        buf    += w;
+        n      -= w;
+        offset += w;
+    }
+}
+
+// Link the IO_DEPTH requests of io in a free list
+static io_request *free_requests(io_request *io) {
+    for(int i = 0; i < IO_DEPTH - 1; i++)
+        io[i].next = &io[i+1];
+    io[IO_DEPTH-1].next = NULL;
+
+    return io;
+}
+
+// Ring for a reader or a writer with --io-uring, NULL if it is not used or the
+// kernel does not support it; then the usual system calls are used
+static uring io_ring(struct options opt) {
+    return opt.uring ? uring_create(IO_DEPTH) : NULL;
+}
+
+// Register the buffers of the chunks of pool with the ring, so the kernel
+// does not map them again for every request
+static void register_pool(uring ring, chunk_pool pool) {
+    struct iovec *iov;
+    int n;
+
+    iov = pool_buffers(pool, &n);
+    uring_register_buffers(ring, iov, n);         //si no se pueden registrar (RLIMIT_MEMLOCK) se usan peticiones normales
+    free(iov);
+}
+
+// Read the chunks with io_uring, up to IO_DEPTH at the same time, and add
+// them to batch as their reads complete, sending it to the job when it is
+// full (n chunks are in batch). get(arg, i, &pos) returns chunk i with the
+// size to read from pos in fd, or NULL after the last one. With a reorder
+// window the slot of every chunk is taken in chunk order before it is read.
+static void uring_read_chunks(uring ring, int fd, chunk (*get)(void *, uint64_t, uint64_t *),
+                              void *arg, reorder *order, job *j, chunk *batch, int *n) {
+    io_request io[IO_DEPTH], *free_io = free_requests(io), *r;
+    uint64_t i = 0;
+    int res, last = 0;
+
+    while(!last || uring_pending(ring) > 0) {
+        while(!last && free_io) {                 //lanza lecturas mientras haya sitio en el ring
+            if(order && sem_trywait(&order->free_slots) != 0) {
+                if(uring_pending(ring) > 0)       //el writer puede estar esperando una de las lecturas en vuelo
+                    break;
+                wait_window(order, j, batch, n);
+            }
+            if((free_io->ch = get(arg, i++, &free_io->pos)) == NULL) {
+                last = 1;
+                if(order)
+                    sem_post(&order->free_slots);  //el hueco no se usa
+                break;
+            }
+            r = free_io;
+            free_io = r->next;
+            uring_read(ring, fd, r->ch->data, r->ch->size, r->pos, r->ch->buf_index, r);
+        }
+
+        if(uring_pending(ring) == 0)
+            break;
+
+        r = uring_wait(ring, &res);
+        if(res < 0) {
+            fprintf(stderr, "Error reading chunk %lu: %s\n", (unsigned long) r->ch->num, strerror(-res));
+            exit(EXIT_FAILURE);
+        }
+        for(uint64_t done = res; done < r->ch->size; ) {  //una lectura incompleta se termina con pread
+            ssize_t k = pread(fd, r->ch->data + done, r->ch->size - done, r->pos + done);
+            if(k < 0) {
+                fprintf(stderr, "Error reading chunk %lu: %s\n", (unsigned long) r->ch->num, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if(k == 0) {                          //el fichero es más corto de lo esperado
+                r->ch->size = done;
+                break;
+            }
+            done += k;
+        }
+
+        batch[(*n)++] = r->ch;
+        r->next = free_io;
+        free_io = r;
+        if(*n == j->batch) {
+            job_submit(j, batch, *n);
+            *n = 0;
+        }
+    }
+}
+
+// Wait for a write of the ring of the writer and release its chunk.
+// A write that io_uring completes only in part is finished with pwrite.
+static void complete_write(writerargs *args) {
+    io_request *r;
+    uint64_t done, pos;
+    int res;
+
+    r = uring_wait(args->ring, &res);
+    if(res < 0) {
+        fprintf(stderr, "Error writing chunk %lu: %s\n", (unsigned long) r->ch->num, strerror(-res));
+        exit(EXIT_FAILURE);
+    }
+
+    done = res;
+    pos  = r->pos;
+    for(int i = 0; i < r->niov; i++) {
+        if(done < r->iov[i].iov_len)
+            pwrite_full(r->fd, (unsigned char *) r->iov[i].iov_base + done, r->iov[i].iov_len - done, pos + done);
+        done = done < r->iov[i].iov_len ? 0 : done - r->iov[i].iov_len;
+        pos += r->iov[i].iov_len;
+    }
+
+    free_chunk(r->ch);
+    r->next = args->free_io;
+    args->free_io = r;
+}
+
+// A free request for a write, waiting for one in flight if there is none
+static io_request *write_request(writerargs *args, chunk ch) {
+    io_request *r;
+
+    if(args->free_io == NULL)
+        complete_write(args);
+
+    r = args->free_io;
+    args->free_io = r->next;
+    r->ch = ch;
+
+    return r;
+}
+
+// Wait for every write in flight of the writer
+static void complete_writes(writerargs *args) {
+    while(args->ring && uring_pending(args->ring) > 0)
+        complete_write(args);
+}
+
+static void check_chunk(testargs *test, zcontext ctx, chunk ch);
+static void unreadable_chunk(testargs *test, uint64_t num);
+
+// Codec state of a worker of the pool for the job, created the first time
+// the worker runs one of its tasks. Only that worker uses its slot.
+static zcontext job_context(job *j, int worker) {
+    if(j->ctx[worker] == NULL)
+        j->ctx[worker] = zcontext_create(j->codec, j->level, j->strategy);
+    return j->ctx[worker];
+}
+
+// run the chunks of a task through process (compress or decompress) and send them to queue out
+static void run_task(void *arg, int worker) {
+    task *t = arg;
+    job *j = t->job;
+    zcontext ctx = job_context(j, worker);        //estado del codec propio del thread, se reutiliza
+    chunk out[BATCH];
+    int results = 0, n = t->n;
+
+    for(int i = 0; i < n; i++) {
+        chunk in = t->chunks[i];
+
+        if(j->test) {                             //--test: se comprueba y se descarta
+            check_chunk(j->test, ctx, in);
+            continue;
+        }
+
+        double start = j->sizer ? thread_time() : 0;
+        out[results++] = (j->process)(ctx, in, j->out_pool ? pool_get(j->out_pool) : NULL);  //comprimir/descomprimir
+        if(j->sizer)
+            autosize_record(j->sizer, in->size, out[results-1]->size, thread_time() - start);
+        free_chunk(in);                           //libera memoria del fragmento de entrada
+    }
+    free(t);
+
+    if(results)
+        q_insert_many(j->out, (void **) out, results);  //inserta resultados a cola de salida, espera si está llena
+
+    for(int i = 0; i < n; i++)
+        sem_post(&j->slots);                      //el reader puede enviar más fragmentos
+    job_release(j);
+}
+
+// Chunks sent to the pool and not finished: what the in queue used to hold,
+// plus a task being run by every thread
+static int job_slots(struct options opt) {
+    return opt.queue_size + opt.num_threads*worker_batch(opt);
+}
+
+static void job_init(job *j, task_pool pool, struct options opt) {
+    j->pool     = pool;
+    j->out      = NULL;
+    j->process  = NULL;
+    j->test     = NULL;
+    j->out_pool = NULL;
+    j->codec    = opt.codec;
+    j->level    = opt.level;
+    j->strategy = opt.strategy;
+    j->batch    = worker_batch(opt);
+    j->sizer    = NULL;
+    j->ctx      = calloc(task_pool_threads(pool), sizeof(zcontext));
+    j->pending  = 1;                              //la del reader, hasta end_of_input
+    sem_init(&j->slots, 0, job_slots(opt));
+    sem_init(&j->done, 0, 0);
+}
+
+// Send up to BATCH chunks to the pool as one task, waiting while too many
+// chunks of the job are pending
+static void job_submit(job *j, chunk *batch, int n) {
+    task *t;
+
+    if(n == 0)
+        return;
+
+    for(int i = 0; i < n; i++)
+        sem_wait(&j->slots);
+
+    t = malloc(sizeof(task));
+    t->job = j;
+    t->n   = n;
+    memcpy(t->chunks, batch, n * sizeof(chunk));
+
+    __atomic_add_fetch(&j->pending, 1, __ATOMIC_ACQ_REL);
+    task_pool_submit(j->pool, run_task, t);
+}
+
+// A task, or the reader, is done with the job. The last one sends the NULL
+// that ends the writer.
+static void job_release(job *j) {
+    if(__atomic_sub_fetch(&j->pending, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if(j->out)
+        q_insert(j->out, NULL);
+    sem_post(&j->done);                           //último acceso al job
+}
+
+// Wait for every task of the job and release its codec states
+static void job_finish(job *j) {
+    sem_wait(&j->done);
+
+    for(int i = 0; i < task_pool_threads(j->pool); i++)
+        if(j->ctx[i])
+            zcontext_destroy(j->ctx[i]);
+    free(j->ctx);
+    sem_destroy(&j->slots);
+    sem_destroy(&j->done);
+}
+
+static task_pool workers;                         //threads de compresión, se crean una vez por proceso
+
+// The pool of opt.num_threads workers shared by every job of the process
+static task_pool worker_pool(struct options opt) {
+    if(workers == NULL)
+        workers = task_pool_create(opt.num_threads);
+    return workers;
+}
+
+// Size of the chunk that starts at offset of the input
+static uint64_t next_size(readerargs *args, uint64_t offset) {
+    if(args->sizer)
+        return autosize_next(args->sizer, args->size == UINT64_MAX ? UINT64_MAX : args->size - offset);
+    return args->opt.size;
+}
+
+// chunk i of the input file, read with io_uring
+static chunk input_chunk(void *arg, uint64_t i, uint64_t *pos) {
+    readerargs * args = arg;
+    uint64_t size;
+    chunk ch;
+
+    if(args->offset == args->size)
+        return NULL;
+
+    size = next_size(args, args->offset);
+    ch = pool_get(args->pool);
+    ch->num    = args->seq++;                     //i empieza en 0 en cada fichero
+    ch->file   = args->file - args->files;
+    ch->offset = args->offset;
+    ch->size   = args->size - ch->offset < size ? args->size - ch->offset : size;
+    *pos = ch->offset;
+    args->offset += ch->size;
+
+    return ch;
+}
+
+// FILE - reads from stdin; the output goes to stdout if -o - is given
+// or if the input is stdin and there is no -o
+static int use_stdout(struct options opt) {
+    return opt.out_file ? !strcmp(opt.out_file, "-") : !strcmp(opt.file, "-");
+}
+
+// Open the input file f for the reader, map it if it can, and create its
+// archive. Returns 0 if the file cannot be read; it is skipped.
+static int open_input(readerargs *args, input_file *f) {
+    struct options opt = args->opt;
+    char comp_file[256];
+    struct stat st;
+
+    if(!strcmp(f->name, "-"))
+        args->fd = 0;
+    else if((args->fd = open(f->name, O_RDONLY)) == -1) {
+        fprintf(stderr, "Cannot open %s\n", f->name);
+        return 0;
+    }
+
+    fstat(args->fd, &st);
+    if(S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "%s is a directory\n", f->name);
+        close(args->fd);
+        return 0;
+    }
+
+    args->size   = S_ISREG(st.st_mode) ? (uint64_t) st.st_size : UINT64_MAX;
+    args->offset = 0;
+    args->map    = NULL;
+
+    // Los ficheros regulares se mapean en memoria para que los workers compriman
+    // directamente desde la page cache. Si no se puede, el reader usa read().
+    // Con --io-uring se leen con varias lecturas en vuelo en lugar de mapearlos.
+    if(!args->ring && opt.use_mmap && S_ISREG(st.st_mode) && st.st_size > 0) {
+        args->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, args->fd, 0);
+        if(args->map == MAP_FAILED)
+            args->map = NULL;
+        else
+            madvise(args->map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if(args->container) {
+        f->ar = args->container;                  //los fragmentos se numeran seguidos en el mismo archivo
+    } else if(use_stdout(opt)) {
+        f->ar = create_archive_stream(1, "stdout", opt.codec);   //sin índice en la cabecera, el número de fragmentos va en el footer
+    } else {
+        if(opt.out_file) {
+            strncpy(comp_file,opt.out_file,255);
+        } else {
+            strncpy(comp_file, f->name, 255);
+            strncat(comp_file, ".ch", 255);
+        }
+
+        f->ar = create_archive_file(comp_file, opt.codec);
+    }
+
+    f->map   = args->map;                         //el writer lo libera cuando termina el archivo
+    f->size  = args->size;
+    f->mode  = st.st_mode;
+    f->mtime = st.st_mtime;
+    f->first = args->seq;
+    args->file = f;
+
+    return 1;
+}
+
+// Read the file of the reader in chunks and add them to batch, sending it
+// to the pool every time it is full. The chunks are numbered after those of
+// the files read before, so the reorder window and the tasks go on from one
+// file to the next.
+static void read_input(readerargs *args, chunk *batch, int *n) {
+    uint64_t offset = 0;                          //posición actual del archivo
+    long page_size = sysconf(_SC_PAGESIZE);
+    chunk ch;
+
+    if(args->ring && args->size != UINT64_MAX) {  //varias lecturas en vuelo, el tamaño del fichero se conoce
+        uring_read_chunks(args->ring, args->fd, input_chunk, args, args->order, args->job, batch, n);
+        return;
+    }
+
+    // se lee hasta el final del fichero, su tamaño no se conoce si es una tubería
+    while(1){
+        uint64_t size = next_size(args, offset);  //opt.size, o el que decide --auto-size
+
+        if(args->map) {                           //el fragmento apunta directamente al fichero mapeado, sin copia
+            if(offset == args->size)
+                break;
+            ch = map_chunk(args->map + offset, args->size - offset < size ? args->size - offset : size);
+
+            uintptr_t page = (uintptr_t) ch->data & ~(uintptr_t) (page_size-1);
+            madvise((void *) page, (uintptr_t) ch->data + ch->size - page, MADV_WILLNEED);  //lectura anticipada del fragmento
+        } else {
+            ch = pool_get(args->pool);            //buffer reutilizado para el fragmento
+            ch->size = 0;
+
+            while(ch->size < size) {              //una tubería puede devolver menos bytes de los pedidos
+                ssize_t k = read(args->fd, ch->data + ch->size, size - ch->size);
+                if(k < 0) {
+                    fprintf(stderr, "Error reading %s: %s\n", args->file->name, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                if(k == 0)
+                    break;
+                ch->size += k;
+            }
+            if(ch->size == 0) {                   //fin del fichero
+                free_chunk(ch);
+                break;
+            }
+        }
+        ch->num    = args->seq++;                 //número de fragmento en el pipeline
+        ch->file   = args->file - args->files;
+        ch->offset = offset;
+        offset    += ch->size;
+
+        if(args->order)
+            wait_window(args->order, args->job, batch, n);  //espera a que el writer tenga sitio para el fragmento
+
+        batch[(*n)++] = ch;
+        if(*n == args->job->batch) {              //envía los fragmentos al pool como una tarea
+            job_submit(args->job, batch, *n);
+            *n = 0;
+        }
+    }
+}
+
+void * reader(void *arg){                         //lee los ficheros y envía sus fragmentos al pool
     readerargs * args = arg;                      //args será un struct de tipo readerargs
-    chunk ch;                                   
-                                     
-    
-    for(int i = 0;i<args->chunks;i++){
-         ch = alloc_chunk(args->opt.size);         //asignamos memoria para el fragmento
+    chunk batch[BATCH];                           //los ficheros pequeños comparten tarea
+    int n = 0;
+
+    for(int i = 0; i < args->nfiles; i++) {
+        input_file *f = &args->files[i];
+        chunk end;
 
-        offset=lseek(args->fd, 0, SEEK_CUR);      //obtener pos del archivo de entrada para saber dónde empieza el fragmento
+        if(!open_input(args, f))
+            continue;
 
-        ch->size   = read(args->fd, ch->data, args->opt.size);          //lee el contenido, lo almacena en size y guarda bytes leidos en size
-        ch->num    = i;                           //número de fragmento 
-        ch->offset = offset;                      
+        read_input(args, batch, &n);
+        if(args->fd != 0)
+            close(args->fd);                      //el mapa sigue siendo válido hasta que lo libere el writer
 
-        sem_wait(args->q_in_free_spaces);         //espera que haya espacio en cola de entrada
-        q_insert(args->in, ch);                   //inserta el fragmento en cola de entrada
-        sem_post(args->q_in_available_chunks);    //indica que hay nuevo fragmento disponible
+        // el writer cierra el archivo cuando tiene el aviso y todos sus fragmentos
+        f->chunks = args->seq - f->first;
+        end = map_chunk(NULL, 0);
+        end->num  = FILE_END;
+        end->file = i;
+        q_insert(args->job->out, end);
     }
 
+    end_of_input(args->job, batch, n);
+
   return NULL;
 
 }
 
+// Close the archive of f, or add f to the directory of the container, once
+// the writer has the end of the file from the reader and all of its chunks,
+// and release the mapped input
+static void finish_file(writerargs *args, input_file *f) {
+  if(!f->read || f->written < f->chunks)
+    return;
+
+  if(args->ar) {
+    add_archive_file(args->ar, f->name, f->mode, f->mtime, f->first, f->chunks);
+  } else {
+    complete_writes(args);                        //puede haber escrituras del archivo en vuelo
+    if(close_archive_file(f->ar))
+      args->failed = 1;                           //comp termina con error
+  }
+  if(f->map) munmap(f->map, f->size);
+}
+
+// Append ch to the archive of its file. With io_uring the write is left in
+// flight and ch is freed when it completes.
+static void append_chunk(writerargs *args, chunk ch) {
+  input_file *f = &args->files[ch->file];
+  io_request *r;
+
+  if(args->ar == NULL)
+    ch->num -= f->first;                          //número del fragmento en su archivo
+
+  if(args->ring == NULL) {
+    add_chunk(f->ar, ch);
+    free_chunk(ch);
+  } else {
+    r = write_request(args, ch);
+    r->pos = place_chunk(f->ar, ch, r->header);   //el índice se actualiza ya, la escritura queda en vuelo
+    r->iov[0].iov_base = r->header;
+    r->iov[0].iov_len  = sizeof(r->header);
+    r->iov[1].iov_base = ch->data;
+    r->iov[1].iov_len  = ch->size;
+    r->niov = 2;
+    r->fd   = f->ar->fd;
+    uring_writev(args->ring, r->fd, r->iov, r->niov, r->pos, r);
+  }
+
+  f->written++;
+  finish_file(args, f);
+}
+
+static void add_in_order(void *arg, chunk ch) {
+  append_chunk(arg, ch);
+}
+
+// take compressed chunks from the out queue and append them to the archive of
+// their file as they come, or in chunk order through the reorder window (--ordered)
 void * writer(void *arg){
   writerargs * args = arg;                        //declara un puntero de tipo writerargs
-  chunk ch;                                       //para almacenar los datos
-  int i = 0;
+  chunk batch[BATCH];                             //para almacenar los datos
+  int running = 1;
 
-  for (i = 0; i < args->chunks; i++){            
-    sem_wait(args->q_out_available_chunks);       //espera a que haya chunks disponibles
-    ch = q_remove(args->out);                     //extrae un chunk de la cola de salida
-    sem_post(args->q_out_free_spaces);            //indica que hay un espacio libre en cola de salida
+  while (running){
+    int n = q_remove_up_to(args->out, (void **) batch, BATCH);  //extrae chunks de la cola de salida
 
-    add_chunk(args->ar, ch);                    
-    free_chunk(ch);
+    for(int i = 0; i < n; i++) {
+      if(batch[i] == NULL) {                      //el job ha terminado, es el último
+        running = 0;
+        continue;
+      }
+
+      if(batch[i]->num == FILE_END) {             //el reader ha leído todo el fichero
+        input_file *f = &args->files[batch[i]->file];
+
+        f->read = 1;
+        free_chunk(batch[i]);
+        finish_file(args, f);
+        continue;
+      }
+
+      if(args->order) {
+        reorder_put(args->order, batch[i], add_in_order, args);
+        continue;
+      }
+
+      append_chunk(args, batch[i]);
+    }
+
+    if(args->ring)
+      uring_submit(args->ring);                   //las escrituras del lote se envían juntas
+  }
+
+  complete_writes(args);
+
+  return NULL;
+}
+
+// chunk i of the archive, read with io_uring
+static chunk archive_chunk(void *arg, uint64_t i, uint64_t *pos) {
+  archivereaderargs * args = arg;
+  archive ar = args->ar;
+  chunk ch;
+
+  i += args->first;
+  if(i >= args->last)
+    return NULL;
+
+  ch = args->pool ? pool_get(args->pool) : alloc_chunk(ar->chunk_size[i]);
+
+  ch->size      = ar->chunk_size[i];
+  ch->num       = i;
+  ch->offset    = ar->file_offset[i];
+  ch->orig_size = ar->orig_size[i];
+  ch->flags     = ar->flags[i];
+  ch->crc       = ar->crc[i];
+  *pos = ar->archive_offset[i];
+
+  return ch;
+}
+
+// take chunks from the archive in order and send them to the pool
+void * archive_reader(void *arg){
+  archivereaderargs * args = arg;
+  chunk ch, batch[BATCH];
+  int n = 0;
+
+  if(args->ring) {
+    uring_read_chunks(args->ring, args->ar->fd, archive_chunk, args, args->order, args->job, batch, &n);
+    end_of_input(args->job, batch, n);
+    return NULL;
+  }
+
+  for(uint64_t i = args->first; ; i++){
+    testargs *test = args->job->test;             //con --test un fragmento que no se puede leer es un fragmento dañado
+    uint64_t bad = ARCHIVE_END_CHUNK;
+
+    if(args->ar->stream)                          //un archivo leído de una tubería se recorre en orden
+      ch = test ? try_next_chunk(args->ar, &bad) : next_chunk(args->ar);
+    else if(i < args->last) {                     //lee el fragmento comprimido del archivo
+      chunk buf = args->pool ? pool_get(args->pool) : NULL;
+
+      ch = test ? try_get_chunk_into(args->ar, i, buf) : get_chunk_into(args->ar, i, buf);
+      if(ch == NULL)
+        bad = i;
+    } else
+      ch = NULL;
+
+    if(bad != ARCHIVE_END_CHUNK) {
+      unreadable_chunk(test, bad);
+      if(args->ar->stream)                        //una tubería no se puede leer más allá del error
+        break;
+      continue;
+    }
+    if(ch == NULL)
+      break;
+
+    // en una tubería los fragmentos vienen en el orden del archivo, no se puede esperar
+    // al writer porque el siguiente fragmento que necesita puede estar más adelante
+    if(args->order && !args->ar->stream)
+      wait_window(args->order, args->job, batch, &n);  //espera a que el writer tenga sitio para el fragmento
+
+    batch[n++] = ch;
+    if(n == args->job->batch) {
+      job_submit(args->job, batch, n);
+      n = 0;
+    }
   }
 
+  end_of_input(args->job, batch, n);
+
   return NULL;
 }
 
+static void write_in_order(void *arg, chunk ch) {
+  writerargs * args = arg;
+
+  write_full(args->fd, ch->data, ch->size);
+  free_chunk(ch);
+}
+
+// take decompressed chunks from the out queue and write each one at its offset,
+// or in chunk order through the reorder window when the output is a pipe
+void * file_writer(void *arg){
+  writerargs * args = arg;
+  chunk ch, batch[BATCH];
+  int running = 1;
+
+  while (running){
+    int n = q_remove_up_to(args->out, (void **) batch, BATCH);
+
+    for(int i = 0; i < n; i++) {
+      ch = batch[i];
+      if(ch == NULL) {
+        running = 0;
+        continue;
+      }
 
-// Compress file taking chunks of opt.size from the input file,
-// inserting them into the in queue, running them using a worker,
-// and sending the output from the out queue into the archive file
+      if(args->order) {
+        reorder_put(args->order, ch, write_in_order, args);
+        continue;
+      }
+
+      if(args->ring) {                            //la escritura queda en vuelo, el fragmento se libera al terminar
+        io_request *r = write_request(args, ch);
+
+        r->pos = ch->offset;
+        r->iov[0].iov_base = ch->data;
+        r->iov[0].iov_len  = ch->size;
+        r->niov = 1;
+        r->fd   = args->fd;
+        uring_write(args->ring, args->fd, ch->data, ch->size, ch->offset, ch->buf_index, r);
+        continue;
+      }
+
+      pwrite_full(args->fd, ch->data, ch->size, ch->offset);  //escritura posicional, sin lseek compartido
+      free_chunk(ch);
+    }
+
+    if(args->ring)
+      uring_submit(args->ring);
+  }
+
+  complete_writes(args);
+
+  return NULL;
+}
+
+// Compress the input files taking chunks of opt.size from each one in
+// turn, sending them in tasks to the worker pool, and the output from the
+// out queue into the archive of every file. The files share the reader, the
+// pool and the writer, so the workers keep busy across small files.
 void comp(struct options opt) {
-    int fd, chunks;
-    char comp_file[256];
-    struct stat st;
-    archive ar;
-    queue in, out;
+    input_file *files;
+    queue out;
+    job work;
+    chunk_pool in_pool, out_pool;
+    zcontext ctx;
+    reorder *order = NULL;
+    uring in_ring = NULL, out_ring = NULL;
+    autosize *sizer = NULL;
+    uint64_t min_size = opt.size, max_size = opt.size;  //límites del tamaño de los fragmentos
+    uint64_t input_chunks = 0;                    //fragmentos de la entrada (UINT64_MAX si no se conoce)
 
-    pthread_t * workerthreads = malloc(sizeof(pthread_t) * opt.num_threads); //los threads para worker
     pthread_t thread_reader;                                                 //thread para reader
     pthread_t thread_writer;                                                 //thread para writer
 
-    //semaforos para In y Out
-    sem_t in_sem;
-    sem_t out_sem;
-    sem_t in_free_spaces;
-    sem_t out_free_spaces;
-
-    //inicializacion de los semaforos
-    sem_init(&in_sem,0,0);
-    sem_init(&out_sem,0,0);
-    sem_init(&in_free_spaces,0,opt.queue_size);
-    sem_init(&out_free_spaces,0,opt.queue_size);
-
-    if((fd=open(opt.file, O_RDONLY))==-1) {
-        printf("Cannot open %s\n", opt.file);
-        exit(0);
+    // con --auto-size el reader elige el tamaño de cada fragmento con las medidas de los workers
+    if(opt.auto_size) {
+        sizer = autosize_create(opt.size, opt.num_threads);
+        min_size = AUTO_MIN_SIZE;
+        max_size = AUTO_MAX_SIZE;
     }
 
-    fstat(fd, &st);
-    chunks = st.st_size/opt.size+(st.st_size % opt.size ? 1:0);
+    files = calloc(opt.nfiles, sizeof(input_file));
+    for(int i = 0; i < opt.nfiles; i++) {
+        struct stat st;
 
-    if(opt.out_file) {
-        strncpy(comp_file,opt.out_file,255);
-    } else {
-        strncpy(comp_file, opt.file, 255);
-        strncat(comp_file, ".ch", 255);
+        files[i].name = opt.files[i];
+        if(input_chunks != UINT64_MAX && strcmp(files[i].name, "-") && stat(files[i].name, &st) == 0 && S_ISREG(st.st_mode))
+            input_chunks += st.st_size / min_size + 1;
+        else
+            input_chunks = UINT64_MAX;            //una tubería puede tener cualquier tamaño
     }
 
-    ar = create_archive_file(comp_file);
+    // con --io-uring los ficheros regulares se leen con varias lecturas en vuelo
+    if(strcmp(opt.file, "-"))
+        in_ring = io_ring(opt);
 
-    in  = q_create(opt.queue_size);
     out = q_create(opt.queue_size);
-    
+
+    // con --ordered los fragmentos se guardan en orden, el archivo se lee de forma secuencial
+    if(opt.ordered)
+        order = reorder_create(pipeline_chunks(opt));
+
+    // los buffers de los fragmentos se reutilizan, cuando el pipeline está en marcha no se reserva memoria
+    uint64_t pool_chunks = pipeline_chunks(opt) + (order ? order->window : 0) + (opt.uring ? IO_DEPTH : 0);
+    if(pool_chunks > input_chunks)
+        pool_chunks = input_chunks;               //no hacen falta más buffers que fragmentos
+    in_pool = pool_create(pool_chunks, max_size); //no se usa con los ficheros mapeados
+    ctx = zcontext_create(opt.codec, opt.level, opt.strategy);
+    out_pool = pool_create(pool_chunks, zcompress_bound(ctx, max_size));
+    zcontext_destroy(ctx);
+
+    if(in_ring)
+        register_pool(in_ring, in_pool);
+    if(!use_stdout(opt))                          //una tubería se escribe en orden con write
+        out_ring = io_ring(opt);
+
+    //WORKERS: las tareas de compresión van al pool de threads del proceso
+    job_init(&work, worker_pool(opt), opt);
+    work.out = out;
+    work.process = zcompress_into;
+    work.out_pool = out_pool;
+    work.sizer = sizer;
+
+    // con --container todos los ficheros van al archivo de -o, con un directorio
+    archive container = NULL;
+    if(opt.container)
+        container = use_stdout(opt) ? create_archive_stream(1, "stdout", opt.codec | ARCHIVE_CONTAINER)
+                                    : create_archive_file(opt.out_file, opt.codec | ARCHIVE_CONTAINER);
 
     //READER inicializacion struct y creacion de thread
     readerargs rargs;
-    rargs.in = in;
-    rargs.fd = fd;
-    rargs.chunks = chunks;
-    rargs.q_in_available_chunks = &in_sem;
-    rargs.q_in_free_spaces = &in_free_spaces;
+    rargs.job = &work;
+    rargs.files = files;
+    rargs.nfiles = opt.nfiles;
+    rargs.seq = 0;
+    rargs.container = container;
+    rargs.sizer = sizer;
+    rargs.pool = in_pool;
+    rargs.order = order;
+    rargs.ring = in_ring;
     rargs.opt = opt;
 
     pthread_create(&thread_reader,NULL,reader,&rargs);
 
-    //WORKERS
-    sem_t sem_remaining_chunks;
-    sem_init(&sem_remaining_chunks,0,chunks);
+    //WRITER
+    writerargs wrargs;
+    wrargs.out = out;
+    wrargs.ar = container;
+    wrargs.files = files;
+    wrargs.order = order;
+    wrargs.ring = out_ring;
+    wrargs.free_io = free_requests(wrargs.io);
+    wrargs.failed = 0;
+
+    pthread_create(&thread_writer,NULL,writer,&wrargs);
+
+    pthread_join(thread_reader,NULL);
+    job_finish(&work);                            //los threads del pool siguen vivos para el siguiente trabajo
+    pthread_join(thread_writer,NULL);             //el writer cierra los archivos
+
+    if(container && close_archive_file(container))   //escribe el índice y el directorio
+        wrargs.failed = 1;
+    if(in_ring) uring_destroy(in_ring);
+    if(out_ring) uring_destroy(out_ring);
+
+    q_destroy(out);
+
+    if(order) reorder_destroy(order);
+    if(sizer) autosize_destroy(sizer);
+    pool_destroy(in_pool);
+    pool_destroy(out_pool);
+    free(files);
+
+    if(wrargs.failed)
+        exit(EXIT_FAILURE);
+}
 
-    workerargs wargs;
-    wargs.in = in;
-    wargs.out = out;
-    wargs.process = zcompress;
-    wargs.sem_remaining_chunks = &sem_remaining_chunks;
-    wargs.q_in_available_chunks = &in_sem;
-    wargs.q_out_available_chunks = &out_sem;
-    wargs.q_in_free_spaces = &in_free_spaces;
-    wargs.q_out_free_spaces = &out_free_spaces;
 
-    for(int i =0; i < opt.num_threads; i++){
-        pthread_create(&workerthreads[i],NULL,worker, &wargs);
+// Decompress chunks first to first+count-1 of the archive (every chunk of
+// a stream) reading them from the archive, sending them in tasks to the
+// worker pool, and writing the output from the out queue to fd at the
+// offset of each chunk. stdout (fd 1) is written in chunk order.
+static void decompress_chunks(struct options opt, archive ar, uint64_t first, uint64_t count, int fd) {
+    queue out;
+    job work;
+    reorder *order = NULL;
+    chunk_pool in_pool = NULL, out_pool = NULL;
+    uring in_ring = NULL, out_ring = NULL;
+
+    pthread_t thread_reader;
+    pthread_t thread_writer;
+
+    if(fd == 1) {
+        // stdout puede ser una tubería: los fragmentos se escriben en orden
+        order = reorder_create(pipeline_chunks(opt));
+        order->next = first;
     }
 
+    out = q_create(opt.queue_size);
+
+    // con el índice se conoce el tamaño máximo de los fragmentos y sus buffers se reutilizan;
+    // los que no caben (o los de un archivo leído de una tubería) se reservan con malloc
+    if(!ar->stream && count > 0) {
+        uint64_t max_size = 0, max_orig_size = 0, min_orig_size = UINT64_MAX;
+        int pool_chunks = pipeline_chunks(opt) + (order ? order->window : 0) + (opt.uring ? IO_DEPTH : 0);
+
+        for(uint64_t i = first; i < first + count; i++) {
+            if(ar->chunk_size[i] > max_size) max_size = ar->chunk_size[i];
+            if(ar->orig_size[i] > max_orig_size) max_orig_size = ar->orig_size[i];
+            if(ar->orig_size[i] < min_orig_size) min_orig_size = ar->orig_size[i];
+        }
+
+        if((uint64_t) pool_chunks > count)
+            pool_chunks = count;                  //no hacen falta más buffers que fragmentos
+
+        in_pool = pool_create(pool_chunks, max_size);
+        if(min_orig_size > 0)                     //los archivos antiguos no guardan el tamaño original
+            out_pool = pool_create(pool_chunks, max_orig_size);
+    }
+
+    // con --io-uring se leen y escriben varios fragmentos a la vez; un archivo leído de
+    // una tubería se recorre en orden y stdout se escribe en orden, con read y write
+    if(!ar->stream && (in_ring = io_ring(opt)) != NULL && in_pool)
+        register_pool(in_ring, in_pool);
+    if(!order && (out_ring = io_ring(opt)) != NULL && out_pool)
+        register_pool(out_ring, out_pool);
+
+    //WORKERS
+    job_init(&work, worker_pool(opt), opt);
+    work.out = out;
+    work.process = zdecompress_into;
+    work.out_pool = out_pool;
+    work.codec = ar->codec;                       //el codec se lee de la cabecera del archivo
+    work.level = -1;
+    work.strategy = -1;
+
+    //READER
+    archivereaderargs rargs;
+    rargs.job = &work;
+    rargs.ar = ar;
+    rargs.first = first;
+    rargs.last = first + count;
+    rargs.order = order;
+    rargs.pool = in_pool;
+    rargs.ring = in_ring;
+
+    pthread_create(&thread_reader,NULL,archive_reader,&rargs);
+
     //WRITER
     writerargs wrargs;
-    wrargs.chunks = chunks;
+    wrargs.fd = fd;
+    wrargs.order = order;
     wrargs.out = out;
-    wrargs.q_out_available_chunks = &out_sem;
-    wrargs.q_out_free_spaces = &out_free_spaces;
     wrargs.ar = ar;
+    wrargs.ring = out_ring;
+    wrargs.free_io = free_requests(wrargs.io);
 
-    pthread_create(&thread_writer,NULL,writer,&wrargs);
+    pthread_create(&thread_writer,NULL,file_writer,&wrargs);
 
     pthread_join(thread_reader,NULL);
+    job_finish(&work);
+    pthread_join(thread_writer,NULL);
+
+    if(in_ring) uring_destroy(in_ring);
+    if(out_ring) uring_destroy(out_ring);
+
+    q_destroy(out);
 
-    for (int i = 0; i < opt.num_threads;i++) { 
-       pthread_join(workerthreads[i],NULL); 
+    if(order) reorder_destroy(order);
+    if(in_pool) pool_destroy(in_pool);
+    if(out_pool) pool_destroy(out_pool);
+}
+
+// A name stored in a container is extracted below the current directory:
+// absolute names and names with .. are refused
+static int safe_name(char *name) {
+    if(name[0] == '/' || name[0] == '\0')
+        return 0;
+
+    for(char *p = name; p; p = strchr(p, '/')) {
+        if(*p == '/')                             //siguiente componente
+            p++;
+        if(!strncmp(p, "..", 2) && (p[2] == '/' || p[2] == '\0'))
+            return 0;
     }
 
-    pthread_join(thread_writer,NULL);
+    return 1;
+}
 
-    close_archive_file(ar);
-    close(fd);
+// Create the directories in the path of name that do not exist
+static void make_dirs(char *name) {
+    char *path = strdup(name);
 
-    q_destroy(in);
-    q_destroy(out);
+    for(char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if(mkdir(path, 0777) == -1 && errno != EEXIST) {
+            fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        *p = '/';
+    }
+    free(path);
+}
+
+// Decompress the file f of a container archive to out (- for stdout), or
+// to its own name restoring its mode and modification time
+static void extract_file(struct options opt, archive ar, archive_file *f, char *out) {
+    int fd = 1;
+
+    if(out == NULL && !safe_name(f->name)) {
+        fprintf(stderr, "%s: unsafe name, not extracted\n", f->name);
+        return;
+    }
 
-    sem_destroy(&in_sem);
-    sem_destroy(&out_sem);
-    sem_destroy(&in_free_spaces);
-    sem_destroy(&out_free_spaces);
-    sem_destroy(&sem_remaining_chunks);
+    if(out == NULL || strcmp(out, "-")) {
+        char *name = out ? out : f->name;
 
-    free(workerthreads);
+        if(out == NULL)
+            make_dirs(name);
+        if((fd=open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))== -1) {
+            fprintf(stderr, "Cannot create %s: %s\n", name, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    decompress_chunks(opt, ar, f->first, f->chunks, fd);
+
+    if(fd != 1) {
+        if(out == NULL) {
+            struct timespec times[2] = { { 0, UTIME_OMIT }, { f->mtime, 0 } };
+
+            fchmod(fd, f->mode & 07777);
+            futimens(fd, times);
+        }
+        close(fd);
+    }
 }
 
+// Decompress the file opt.name of a container archive, or all of its files
+static void extract_files(struct options opt, archive ar) {
+    archive_file *f;
 
-// Decompress file taking chunks of size opt.size from the input file
+    if(ar->stream) {
+        fprintf(stderr, "The files of a container are found with its index, it cannot be read from a pipe\n");
+        exit(EXIT_FAILURE);
+    }
 
+    if(opt.name == NULL) {
+        if(opt.out_file) {
+            fprintf(stderr, "-o needs --name to decompress a container\n");
+            exit(EXIT_FAILURE);
+        }
+        for(uint64_t i = 0; i < ar->files; i++)
+            extract_file(opt, ar, &ar->dir[i], NULL);
+        return;
+    }
+
+    if((f = find_archive_file(ar, opt.name)) == NULL) {
+        fprintf(stderr, "%s is not in %s\n", opt.name, ar->name);
+        exit(EXIT_FAILURE);
+    }
+    extract_file(opt, ar, f, opt.out_file);
+}
+
+// Decompress file, or the files of a container archive
 void decomp(struct options opt) {
-    int fd, i;
+    int fd;
     char uncomp_file[256];
     archive ar;
-    chunk ch, res;
 
-    if((ar=open_archive_file(opt.file))==NULL) {
-        printf("Cannot open archive file\n");
-        exit(0);
+    if(!strcmp(opt.file, "-"))
+        ar = open_archive_stream(0, "stdin");     //los fragmentos se leen en orden, sin índice
+    else if((ar=open_archive_file(opt.file))==NULL) {
+        fprintf(stderr, "Cannot open archive file\n");
+        exit(EXIT_FAILURE);
     };
 
-    if(opt.out_file) {
-        strncpy(uncomp_file, opt.out_file, 255);
+    if(ar->files > 0 || ar->container || opt.name) {   //en una tubería no hay directorio, solo la marca de la cabecera
+        extract_files(opt, ar);
+        close_archive_file(ar);
+        return;
+    }
+
+    if(use_stdout(opt)) {
+        fd = 1;
     } else {
-        strncpy(uncomp_file, opt.file, strlen(opt.file) -3);
-        uncomp_file[strlen(opt.file)-3] = '\0';
+        if(opt.out_file) {
+            strncpy(uncomp_file, opt.out_file, 255);
+        } else {
+            strncpy(uncomp_file, opt.file, strlen(opt.file) -3);
+            uncomp_file[strlen(opt.file)-3] = '\0';
+        }
+
+        if((fd=open(uncomp_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))== -1) {
+            fprintf(stderr, "Cannot create %s: %s\n", uncomp_file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
     }
 
-    if((fd=open(uncomp_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))== -1) {
-        printf("Cannot create %s: %s\n", uncomp_file, strerror(errno));
-        exit(0);
+    decompress_chunks(opt, ar, 0, ar->stream ? UINT64_MAX : chunks(ar), fd);
+
+    close_archive_file(ar);
+    close(fd);
+}
+
+// List the files of a container archive: mode, size, modification time and name
+void list(struct options opt) {
+    archive ar = open_archive_file(opt.file);
+
+    if(ar->files == 0)
+        printf("%s holds a single file of %lu chunks\n", ar->name, (unsigned long) chunks(ar));
+
+    for(uint64_t i = 0; i < ar->files; i++) {
+        archive_file *f = &ar->dir[i];
+        uint64_t size = 0;
+        char date[32];
+        time_t mtime = f->mtime;
+
+        if(f->chunks > 0) {                       //el último fragmento termina el fichero
+            uint64_t last = f->first + f->chunks - 1;
+            size = ar->file_offset[last] + ar->orig_size[last];
+        }
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&mtime));
+        printf("%06lo %12lu %s %s\n", (unsigned long) f->mode, (unsigned long) size, date, f->name);
+    }
+
+    close_archive_file(ar);
+}
+
+// Decompress every --range of the original file, opt.range_len[i] bytes from
+// opt.range_start[i], one after another, reading only the chunks that cover
+// them. With --cache the chunks shared by several ranges are decompressed
+// once. The ranges of a container archive are offsets in its file --name.
+// The output goes to stdout unless -o is given
+void extract(struct options opt) {
+    int fd = 1;
+    archive ar;
+    archive_file *f;
+    chunk_cache cache = NULL;
+    unsigned char *buf;
+    uint64_t pos, left, n, first = 0, count;
+
+    if(!strcmp(opt.file, "-")) {
+        fprintf(stderr, "--range needs an archive file, not a pipe\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ar = open_archive_file(opt.file);
+    count = chunks(ar);
+    if(opt.name) {                                //solo los fragmentos del fichero, sus offsets empiezan en 0
+        if((f = find_archive_file(ar, opt.name)) == NULL) {
+            fprintf(stderr, "%s is not in %s\n", opt.name, ar->name);
+            exit(EXIT_FAILURE);
+        }
+        first = f->first;
+        count = f->chunks;
+    } else if(ar->files > 0) {
+        fprintf(stderr, "%s is a container, --range needs --name\n", ar->name);
+        exit(EXIT_FAILURE);
+    }
+    if(opt.cache_size) {
+        cache = cache_create(opt.cache_size);
+        archive_set_cache(ar, cache);
+    }
+
+    if(opt.out_file && strcmp(opt.out_file, "-") &&
+       (fd=open(opt.out_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH))== -1) {
+        fprintf(stderr, "Cannot create %s: %s\n", opt.out_file, strerror(errno));
+        exit(EXIT_FAILURE);
     }
 
-    for(i=0; i<chunks(ar); i++) {
-        ch = get_chunk(ar, i);
+    buf = malloc(RANGE_BUFFER);
+    for(int i = 0; i < opt.range; i++) {
+        pos  = opt.range_start[i];
+        left = opt.range_len[i];
+        while(left > 0) {                         //rangos grandes se leen por partes
+            n = archive_read_file_range(ar, first, count, pos, left < RANGE_BUFFER ? left : RANGE_BUFFER, buf);
+            if(n == 0)                            //fin del fichero original
+                break;
+            write_full(fd, buf, n);
+            pos  += n;
+            left -= n;
+        }
+    }
 
-        res = zdecompress(ch);
-        free_chunk(ch);
+    if(opt.cache_stats) {
+        uint64_t hits, misses, bytes;
 
-        lseek(fd, res->offset, SEEK_SET);
-        write(fd, res->data, res->size);
-        free_chunk(res);
+        cache_stats(cache, &hits, &misses, &bytes);
+        fprintf(stderr, "cache: %lu hits, %lu misses, %lu bytes of %lu\n", (unsigned long) hits,
+                (unsigned long) misses, (unsigned long) bytes, (unsigned long) opt.cache_size);
     }
 
+    free(buf);
+    if(fd != 1) close(fd);
     close_archive_file(ar);
+    if(cache) cache_destroy(cache);               //después de cerrar el archivo, que quita sus fragmentos
+}
+
+static void add_bad_chunk(testargs *args, uint64_t num, int status) {
+    if(args->bad_count == args->bad_size) {
+        args->bad_size = args->bad_size ? 2 * args->bad_size : 64;
+        args->bad = realloc(args->bad, args->bad_size * sizeof(bad_chunk));
+    }
+    args->bad[args->bad_count].num    = num;
+    args->bad[args->bad_count].status = status;
+    args->bad_count++;
+}
+
+static int cmp_bad_chunk(const void *a, const void *b) {
+    const bad_chunk *x = a, *y = b;
+
+    return x->num < y->num ? -1 : x->num > y->num;
+}
+
+// decompress a chunk in memory and check it against its uncompressed size
+// and checksum, keeping its number if it is bad (runs in the worker pool)
+static void check_chunk(testargs *test, zcontext ctx, chunk ch) {
+    archive ar = test->ar;
+    chunk out;
+    int status;
+
+    // los archivos anteriores a la versión 4 no guardan el tamaño original, sale del índice
+    if(ch->orig_size == 0 && !(ch->flags & CHUNK_RAW) && !ar->stream && ch->num + 1 < chunks(ar) &&
+       ar->archive_offset[ch->num + 1] != 0)      //el siguiente puede faltar en un archivo cortado
+        ch->orig_size = ar->file_offset[ch->num + 1] - ar->file_offset[ch->num];
+
+    out = test->out_pool ? pool_get(test->out_pool) : NULL;
+    status = zverify(ctx, ch, &out);
+
+    pthread_mutex_lock(&test->mutex);
+    test->checked++;
+    test->bytes += out->size;
+    if(status != ZCHECK_OK)
+        add_bad_chunk(test, ch->num, status);
+    pthread_mutex_unlock(&test->mutex);
+
+    free_chunk(out);                              //los buffers vuelven a los pools, la memoria no crece
+    free_chunk(ch);
+}
+
+// count a chunk the reader could not read from the archive as bad
+static void unreadable_chunk(testargs *test, uint64_t num) {
+    pthread_mutex_lock(&test->mutex);
+    test->checked++;
+    add_bad_chunk(test, num, ZCHECK_READ);
+    pthread_mutex_unlock(&test->mutex);
+}
+
+// Read every chunk of the archive (or of a stream on stdin) and check it in
+// the worker pool, without writing the data. The memory used is bounded by
+// the chunks pending in the job and the pools. A truncated archive is still
+// checked: the chunks that were cut off are bad, and so are the chunks a
+// stream that ends early never reached when its header records the count.
+// Reports the bad chunks and exits with status 1 if there is any
+void test(struct options opt) {
+    archive ar;
+    job work;
+    testargs args;
+    archivereaderargs rargs;
+    chunk_pool in_pool = NULL;
+    pthread_t thread_reader;
+    double start;
+    uint64_t recorded, missing = 0;
+
+    if(!strcmp(opt.file, "-"))
+        ar = open_archive_stream(0, "stdin");     //los fragmentos se leen en orden, sin índice
+    else if((ar=open_archive_file_salvage(opt.file))==NULL) {
+        fprintf(stderr, "Cannot open archive file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if(ar->version < 8)
+        printf("%s has no checksums (version %d), the chunks are only decompressed\n", ar->name, ar->version);
+
+    args.ar        = ar;
+    args.out_pool  = NULL;
+    args.checked   = 0;
+    args.bytes     = 0;
+    args.bad       = NULL;
+    args.bad_count = 0;
+    args.bad_size  = 0;
+    pthread_mutex_init(&args.mutex, NULL);
+
+    if(!ar->stream && chunks(ar) > 0) {
+        uint64_t max_size = 0, max_orig_size = 0, min_orig_size = UINT64_MAX;
+        int pool_chunks = pipeline_chunks(opt);
+
+        for(uint64_t i = 0; i < chunks(ar); i++) {
+            if(ar->chunk_size[i] > max_size) max_size = ar->chunk_size[i];
+            if(ar->orig_size[i] > max_orig_size) max_orig_size = ar->orig_size[i];
+            if(ar->orig_size[i] < min_orig_size) min_orig_size = ar->orig_size[i];
+        }
+
+        if((uint64_t) pool_chunks > chunks(ar))
+            pool_chunks = chunks(ar);
+
+        in_pool = pool_create(pool_chunks, max_size);
+        if(min_orig_size > 0)
+            args.out_pool = pool_create(opt.num_threads, max_orig_size);  //uno en uso por thread
+    }
+
+    start = now();
+
+    job_init(&work, worker_pool(opt), opt);
+    work.test = &args;
+    work.codec = ar->codec;
+    work.level = -1;
+    work.strategy = -1;
+
+    rargs.job = &work;
+    rargs.ar = ar;
+    rargs.first = 0;
+    rargs.last = chunks(ar);
+    rargs.order = NULL;
+    rargs.pool = in_pool;
+    rargs.ring = NULL;
+
+    pthread_create(&thread_reader, NULL, archive_reader, &rargs);
+    pthread_join(thread_reader, NULL);
+    job_finish(&work);
+
+    // una tubería que termina antes de tiempo no llega a algunos fragmentos, si la cabecera
+    // guarda cuántos son (no en ARCHIVE_STREAMED) se cuentan como dañados
+    recorded = chunks(ar);
+    if(ar->stream && recorded > args.checked)
+        missing = recorded - args.checked;
+    if(recorded < args.checked + missing)
+        recorded = args.checked + missing;
+
+    if(args.bad_count)
+        qsort(args.bad, args.bad_count, sizeof(bad_chunk), cmp_bad_chunk);
+    for(uint64_t i = 0; i < args.bad_count; i++)
+        fprintf(stderr, "Chunk %lu: %s\n", (unsigned long) args.bad[i].num, zcheck_error(args.bad[i].status));
+    if(missing)
+        fprintf(stderr, "%lu chunks missing after the end of %s\n", (unsigned long) missing, ar->name);
+
+    if(args.bad_count || missing)
+        fprintf(stderr, "%s: %lu of %lu chunks bad\n", ar->name, (unsigned long) (args.bad_count + missing), (unsigned long) recorded);
+    else
+        printf("%s: %lu chunks, %lu bytes OK (%.1f MB/s, crc32c %s)\n", ar->name, (unsigned long) args.checked,
+               (unsigned long) args.bytes, args.bytes / (now() - start) / 1e6, crc32c_impl());
+
+    close_archive_file(ar);
+    if(in_pool) pool_destroy(in_pool);
+    if(args.out_pool) pool_destroy(args.out_pool);
+    pthread_mutex_destroy(&args.mutex);
+    free(args.bad);
+
+    if(args.bad_count || missing)
+        exit(EXIT_FAILURE);
+}
+
+// Compress the first BENCH_SAMPLE bytes of opt.file in chunks of opt.size at
+// every level of the codec on one thread, and report the compression ratio
+// and the compression and decompression speed of each level
+void bench(struct options opt) {
+    int fd, min_level, max_level;
+    uint64_t sample = 0, nchunks, i;
+    ssize_t n;
+    unsigned char *buf;
+    chunk *in, *out;
+
+    if((fd=open(opt.file, O_RDONLY))==-1) {
+        fprintf(stderr, "Cannot open %s\n", opt.file);
+        exit(EXIT_FAILURE);
+    }
+
+    buf = malloc(BENCH_SAMPLE);
+    while(sample < BENCH_SAMPLE && (n = read(fd, buf + sample, BENCH_SAMPLE - sample)) > 0)
+        sample += n;
     close(fd);
+
+    if(sample == 0) {
+        fprintf(stderr, "%s is empty\n", opt.file);
+        exit(EXIT_FAILURE);
+    }
+
+    nchunks = sample/opt.size + (sample % opt.size ? 1:0);
+    in  = malloc(nchunks * sizeof(chunk));
+    out = malloc(nchunks * sizeof(chunk));
+
+    for(i = 0; i < nchunks; i++) {                //los fragmentos apuntan al buffer de la muestra
+        in[i] = malloc(sizeof(*in[i]));
+        in[i]->data      = buf + i*opt.size;
+        in[i]->size      = i == nchunks-1 ? sample - i*opt.size : (uint64_t) opt.size;
+        in[i]->num       = i;
+        in[i]->offset    = i*opt.size;
+        in[i]->orig_size = 0;
+        in[i]->flags     = 0;
+        in[i]->crc       = 0;
+        in[i]->mapped    = 1;
+        in[i]->pool      = NULL;
+        in[i]->buf_index = -1;
+    }
+
+    codec_levels(opt.codec, &min_level, &max_level);
+    if(opt.level >= 0) min_level = max_level = opt.level;
+
+    printf("%s: %lu bytes in %lu chunks of %d bytes, codec %s\n",
+           opt.file, (unsigned long) sample, (unsigned long) nchunks, opt.size, codec_name(opt.codec));
+    printf("level     ratio   compress MB/s   decompress MB/s\n");
+
+    for(int level = min_level; level <= max_level; level++) {
+        zcontext ctx = zcontext_create(opt.codec, level, opt.strategy);
+        uint64_t comp_size = 0;
+        double t0, t1, t2;
+
+        t0 = now();
+        for(i = 0; i < nchunks; i++) {
+            out[i] = zcompress_ctx(ctx, in[i]);
+            comp_size += out[i]->size;
+        }
+        t1 = now();
+        for(i = 0; i < nchunks; i++) {
+            chunk res = zdecompress_ctx(ctx, out[i]);
+            free_chunk(res);
+        }
+        t2 = now();
+
+        printf("%5d   %7.3f   %13.1f   %15.1f\n", level, (double) sample / comp_size,
+               sample / (t1-t0) / 1e6, sample / (t2-t1) / 1e6);
+
+        for(i = 0; i < nchunks; i++)
+            free_chunk(out[i]);
+        zcontext_destroy(ctx);
+    }
+
+    for(i = 0; i < nchunks; i++)
+        free(in[i]);
+    free(in);
+    free(out);
+    free(buf);
+}
+
+typedef struct{                                   //ficheros que se comprimen con -r
+    char **names;
+    int n, size;
+}file_list;
+
+static void add_name(file_list *l, char *name) {
+    if(l->n == l->size) {
+        l->size = l->size ? 2*l->size : 64;
+        l->names = realloc(l->names, l->size * sizeof(char *));
+        if(l->names == NULL) {
+            perror("Error allocating memory for the file list");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->names[l->n++] = name;
+}
+
+static int cmp_name(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+// Add the regular files under path to l, going into its subdirectories.
+// Archives (.ch) are left out so a second run does not compress them again;
+// symbolic links to directories are not followed.
+static void add_tree(file_list *l, char *path) {
+    struct dirent *e;
+    struct stat st;
+    DIR *dir;
+
+    if(lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        size_t len = strlen(path);
+
+        if(stat(path, &st) == 0 && S_ISREG(st.st_mode) && (len < 3 || strcmp(path + len - 3, ".ch")))
+            add_name(l, path);
+        else
+            free(path);
+        return;
+    }
+
+    if((dir = opendir(path)) == NULL) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        free(path);
+        return;
+    }
+    while((e = readdir(dir)) != NULL) {
+        char *name;
+
+        if(!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+            continue;
+        name = malloc(strlen(path) + strlen(e->d_name) + 2);
+        sprintf(name, "%s/%s", path, e->d_name);
+        add_tree(l, name);
+    }
+    closedir(dir);
+    free(path);
+}
+
+// With -r replace the directories in opt->files by the files they hold,
+// sorted by name so files of the same directory go one after another
+static void expand_dirs(struct options *opt, file_list *l) {
+    for(int i = 0; i < opt->nfiles; i++) {
+        struct stat st;
+        int first = l->n;
+
+        if(stat(opt->files[i], &st) != 0 || !S_ISDIR(st.st_mode)) {
+            add_name(l, strdup(opt->files[i]));   //se comprime aunque sea un .ch, como sin -r
+            continue;
+        }
+        add_tree(l, strdup(opt->files[i]));
+        qsort(l->names + first, l->n - first, sizeof(char *), cmp_name);
+    }
+
+    if(l->n == 0) {
+        fprintf(stderr, "No files to compress\n");
+        exit(EXIT_FAILURE);
+    }
+    if(l->n > 1 && opt->out_file && !opt->container) {
+        fprintf(stderr, "-o cannot be used with several files\n");
+        exit(EXIT_FAILURE);
+    }
+
+    opt->files  = l->names;
+    opt->nfiles = l->n;
+    opt->file   = l->names[0];
+}
+
+static void free_list(file_list *l) {
+    for(int i = 0; i < l->n; i++)
+        free(l->names[i]);
+    free(l->names);
 }
 
 int main(int argc, char *argv[]) {
@@ -269,9 +1776,33 @@ int main(int argc, char *argv[]) {
     opt.size        = CHUNK_SIZE;
     opt.queue_size  = QUEUE_SIZE;
     opt.out_file    = NULL;
+    opt.codec       = CODEC_ZLIB;
+    opt.level       = -1;
+    opt.strategy    = -1;
+    opt.use_mmap    = 1;
+    opt.ordered     = 0;
+    opt.range       = 0;
+    opt.cache_size  = 0;
+    opt.cache_stats = 0;
+    opt.uring       = 0;
+    opt.auto_size   = 0;
+    opt.recursive   = 0;
+    opt.container   = 0;
+    opt.name        = NULL;
 
     read_options(argc, argv, &opt);
 
+    file_list inputs = {NULL, 0, 0};
+    if(opt.recursive)
+        expand_dirs(&opt, &inputs);
+
     if(opt.compress == COMPRESS) comp(opt);
+    else if(opt.compress == BENCHMARK) bench(opt);
+    else if(opt.compress == TEST) test(opt);
+    else if(opt.compress == LIST) list(opt);
+    else if(opt.range) extract(opt);
     else decomp(opt);
+
+    if(workers) task_pool_destroy(workers);
+    free_list(&inputs);
 }
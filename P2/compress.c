@@ -1,106 +1,481 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <zlib.h>
 #include "compress.h"
+#include "codec.h"
+#include "crc32c.h"
 
-chunk zcompress(chunk ch) {
-    chunk res;
-    z_stream st;
-    int out_size;
+// zlib backend
+
+typedef struct {
+    z_stream deflate;
+    z_stream inflate;
+    int deflate_ready;
+    int inflate_ready;
+    int level;
+    int strategy;
+} zlib_state;
 
-    out_size = ch->size;
+static void *zlib_create(int level, int strategy) {
+    zlib_state *zs = calloc(1, sizeof(zlib_state));
 
-    res = malloc(sizeof(*res));
+    zs->level    = level;
+    zs->strategy = strategy;
 
-    res->data   = malloc(out_size);
-    res->size   = 0;
-    res->num    = ch->num;
-    res->offset = ch->offset;
+    return zs;
+}
 
-    st.zalloc = Z_NULL;
-    st.zfree  = Z_NULL;
-    st.opaque = Z_NULL;
+static void zlib_destroy(void *state) {
+    zlib_state *zs = state;
+
+    if(zs->deflate_ready) deflateEnd(&zs->deflate);
+    if(zs->inflate_ready) inflateEnd(&zs->inflate);
+    free(zs);
+}
 
-    if(deflateInit(&st, Z_BEST_COMPRESSION) != Z_OK) {
-        printf("Could not initialize zlib\n");
-        exit(0);
+// Get the deflate stream of the state, initializing it on first use
+static z_stream *deflate_stream(zlib_state *zs) {
+    z_stream *st = &zs->deflate;
+
+    if(zs->deflate_ready)
+        return st;
+
+    st->zalloc = Z_NULL;
+    st->zfree  = Z_NULL;
+    st->opaque = Z_NULL;
+
+    if(deflateInit2(st, zs->level, Z_DEFLATED, MAX_WBITS, MAX_MEM_LEVEL, zs->strategy) != Z_OK) {
+        fprintf(stderr, "Could not initialize zlib\n");
+        exit(EXIT_FAILURE);
     }
+    zs->deflate_ready = 1;
 
-    st.avail_in  = ch->size;
-    st.next_in   = ch->data;
-    st.next_out  = res->data;
-    st.avail_out = out_size;
+    return st;
+}
 
-    while(1) {
-        switch(deflate(&st, Z_FINISH)) {
-            case Z_OK:  // Buffer was not big enough
-            case Z_BUF_ERROR:
-                res->data     = realloc(res->data, out_size*2);
-                st.next_out   = res->data+out_size-st.avail_out;
-                st.avail_out += out_size;
-                out_size     *= 2;
-                break;
-            case Z_STREAM_END: // Done
-                res->size = out_size-st.avail_out;
-                deflateEnd(&st);
-                return res;
-            default:
-                printf("Error compressing data\n");
-                deflateEnd(&st);
-                exit(0);
-        }
+// Get the inflate stream of the state ready for a new chunk
+static z_stream *inflate_stream(zlib_state *zs) {
+    z_stream *st = &zs->inflate;
+
+    if(zs->inflate_ready) {
+        inflateReset(st);
+        return st;
     }
 
-    return res;
+    st->zalloc   = Z_NULL;
+    st->zfree    = Z_NULL;
+    st->opaque   = Z_NULL;
+    st->avail_in = 0;
+    st->next_in  = Z_NULL;
+
+    if(inflateInit(st) != Z_OK) {
+        fprintf(stderr, "Could not initialize zlib\n");
+        exit(EXIT_FAILURE);
+    }
+    zs->inflate_ready = 1;
+
+    return st;
 }
 
-chunk zdecompress(chunk ch) {
-    z_stream st;
-    chunk res;
-    int out_size = ch->size*2;
+static uint64_t zlib_bound(void *state, uint64_t size) {
+    return deflateBound(deflate_stream(state), size);
+}
+
+// out_size is at least the deflateBound() of the chunk, so deflate
+// always finishes in a single call
+static uint64_t zlib_compress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    z_stream *st = deflate_stream(state);
+
+    deflateReset(st);
 
-    res = malloc(sizeof(*res));
+    st->avail_in  = ch->size;
+    st->next_in   = ch->data;
+    st->next_out  = out;
+    st->avail_out = out_size;
 
-    res->data   = malloc(out_size);
-    res->num    = ch->num;
-    res->offset = ch->offset;
+    if(deflate(st, Z_FINISH) != Z_STREAM_END) {
+        fprintf(stderr, "Error compressing data\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return out_size-st->avail_out;
+}
 
-    st.zalloc   = Z_NULL;
-    st.zfree    = Z_NULL;
-    st.opaque   = Z_NULL;
+static uint64_t zlib_decompress(void *state, chunk ch, unsigned char *out, uint64_t out_size) {
+    z_stream *st = inflate_stream(state);
 
-    st.avail_in  = ch->size;
-    st.next_in   = ch->data;
-    st.next_out  = res->data;
-    st.avail_out = out_size;
+    st->avail_in  = ch->size;
+    st->next_in   = ch->data;
+    st->next_out  = out;
+    st->avail_out = out_size;
 
-    if(inflateInit(&st) != Z_OK) {
-        printf("Could not initialize zlib\n");
+    switch(inflate(st, Z_FINISH)) {
+        case Z_STREAM_END:
+            return out_size-st->avail_out;
+        case Z_STREAM_ERROR:
+            fprintf(stderr, "Malformed stream (stray pointer?)\n");
+            exit(EXIT_FAILURE);
+        default:                                  // malformed, or larger than out_size
+            return CODEC_ERROR;
     }
+}
+
+// Chunks from archives that do not record the uncompressed size are
+// inflated into a buffer that grows as needed. Returns the size, or
+// CODEC_ERROR with res->size 0 if the data is malformed
+static uint64_t zlib_decompress_unknown_size(zlib_state *zs, chunk ch, chunk res) {
+    z_stream *st;
+    uint64_t out_size = ch->size*2;
+
+    res->data = malloc(out_size);
+
+    st = inflate_stream(zs);
+
+    st->avail_in  = ch->size;
+    st->next_in   = ch->data;
+    st->next_out  = res->data;
+    st->avail_out = out_size;
 
     int ret;
     do {
-        switch(ret=inflate(&st, Z_FINISH)) {
+        switch(ret=inflate(st, Z_FINISH)) {
             case Z_STREAM_ERROR:
-                printf("Malformed stream (stray pointer?)\n");
-                exit(0);
+                fprintf(stderr, "Malformed stream (stray pointer?)\n");
+                exit(EXIT_FAILURE);
             case Z_NEED_DICT:
             case Z_DATA_ERROR:
             case Z_MEM_ERROR:
-                inflateEnd(&st);
-                printf("Error decompressing data\n");
-                exit(0);
+                res->size      = 0;
+                res->orig_size = 0;
+                return CODEC_ERROR;
             case Z_BUF_ERROR:
             case Z_OK:
-                res->data     = realloc(res->data, out_size*2);
-                st.next_out   = res->data+out_size-st.avail_out;
-                st.avail_out += out_size;
-                out_size     *= 2;
+                if(st->avail_out > 0 && (ret == Z_BUF_ERROR || st->avail_in == 0)) {
+                    // room is left but the input ended first: the chunk is truncated
+                    res->size      = 0;
+                    res->orig_size = 0;
+                    return CODEC_ERROR;
+                }
+                if(st->avail_out > 0)             // inflate made progress, go on with the rest of the input
+                    break;
+                res->data      = realloc(res->data, out_size*2);
+                st->next_out   = res->data+out_size-st->avail_out;
+                st->avail_out += out_size;
+                out_size      *= 2;
                 break;
             case Z_STREAM_END:
-                res->size = out_size-st.avail_out;
-                inflateEnd(&st);
-                return res;
+                res->size      = out_size-st->avail_out;
+                res->orig_size = res->size;
+                return res->size;
         }
     } while (1);
 }
+
+static codec zlib_codec = {
+    .name          = "zlib",
+    .min_level     = Z_BEST_SPEED,
+    .max_level     = Z_BEST_COMPRESSION,
+    .default_level = Z_BEST_COMPRESSION,
+    .create        = zlib_create,
+    .destroy       = zlib_destroy,
+    .bound         = zlib_bound,
+    .compress      = zlib_compress,
+    .decompress    = zlib_decompress,
+};
+
+// Codec dispatch
+
+#define NUM_CODECS 3
+
+static codec *codecs[NUM_CODECS] = {
+    [CODEC_ZLIB] = &zlib_codec,
+#ifdef HAVE_ZSTD
+    [CODEC_ZSTD] = &zstd_codec,
+#endif
+#ifdef HAVE_LZ4
+    [CODEC_LZ4]  = &lz4_codec,
+#endif
+};
+
+static char *codec_names[NUM_CODECS] = { "zlib", "zstd", "lz4" };
+
+static char *strategy_names[] = {
+    [Z_DEFAULT_STRATEGY] = "default",
+    [Z_FILTERED]         = "filtered",
+    [Z_HUFFMAN_ONLY]     = "huffman",
+    [Z_RLE]              = "rle",
+    [Z_FIXED]            = "fixed",
+};
+
+#define NUM_STRATEGIES ((int) (sizeof(strategy_names)/sizeof(strategy_names[0])))
+
+int codec_by_name(char *name) {
+    for(int i = 0; i < NUM_CODECS; i++)
+        if(codecs[i] && !strcmp(codecs[i]->name, name))
+            return i;
+
+    return -1;
+}
+
+char *codec_name(int codec) {
+    if(codec < 0 || codec >= NUM_CODECS)
+        return "unknown";
+
+    return codec_names[codec];
+}
+
+int strategy_by_name(char *name) {
+    for(int i = 0; i < NUM_STRATEGIES; i++)
+        if(!strcmp(strategy_names[i], name))
+            return i;
+
+    return -1;
+}
+
+int codec_levels(int id, int *min_level, int *max_level) {
+    if(id < 0 || id >= NUM_CODECS || codecs[id] == NULL)
+        return -1;
+
+    *min_level = codecs[id]->min_level;
+    *max_level = codecs[id]->max_level;
+
+    return codecs[id]->default_level;
+}
+
+typedef struct _zcontext {
+    codec *codec;
+    void  *state;
+} _zcontext;
+
+zcontext zcontext_create(int id, int level, int strategy) {
+    zcontext ctx;
+
+    if(id < 0 || id >= NUM_CODECS || codecs[id] == NULL) {
+        fprintf(stderr, "Codec %s is not available\n", codec_name(id));
+        exit(EXIT_FAILURE);
+    }
+
+    ctx = malloc(sizeof(_zcontext));
+
+    ctx->codec = codecs[id];
+    ctx->state = ctx->codec->create(level < 0 ? ctx->codec->default_level : level,
+                                    strategy < 0 ? Z_DEFAULT_STRATEGY : strategy);
+
+    return ctx;
+}
+
+void zcontext_destroy(zcontext ctx) {
+    ctx->codec->destroy(ctx->state);
+    free(ctx);
+}
+
+uint64_t zcompress_bound(zcontext ctx, uint64_t size) {
+    return ctx->codec->bound(ctx->state, size);
+}
+
+// The output buffer is allocated once with the bound of the codec
+chunk zcompress_ctx(zcontext ctx, chunk ch) {
+    return zcompress_into(ctx, ch, NULL);
+}
+
+#define ENTROPY_SLICES    16     // slices of the chunk sampled to estimate its entropy
+#define ENTROPY_SLICE     1024
+#define ENTROPY_MIN_SIZE  4096   // smaller chunks are always compressed
+#define RAW_ENTROPY       7.9    // bits per byte above which a chunk is not compressed
+
+// Order 0 entropy in bits per byte of ENTROPY_SLICES slices spread over the
+// chunk. Compressed and encrypted data (JPEG, gzip...) come close to 8.
+static double chunk_entropy(chunk ch) {
+    uint32_t count[256] = { 0 };
+    uint64_t n = 0, slice = ENTROPY_SLICE;
+    double entropy = 0;
+
+    if(ch->size < ENTROPY_SLICES*slice)
+        slice = ch->size / ENTROPY_SLICES;
+
+    for(int i = 0; i < ENTROPY_SLICES; i++) {
+        unsigned char *p = ch->data + i * ((ch->size - slice) / (ENTROPY_SLICES - 1));
+
+        for(uint64_t j = 0; j < slice; j++)
+            count[p[j]]++;
+        n += slice;
+    }
+
+    for(int i = 0; i < 256; i++)
+        if(count[i])
+            entropy -= (double) count[i] / n * log2((double) count[i] / n);
+
+    return entropy;
+}
+
+// Data that looks random is not run through the codec, and a chunk that does
+// not shrink is stored as is (CHUNK_RAW), so the archive never grows. The
+// CRC32C of the data is kept with the chunk to check it when decompressing
+chunk zcompress_into(zcontext ctx, chunk ch, chunk res) {
+    uint64_t out_size;
+    int raw;
+
+    out_size = ctx->codec->bound(ctx->state, ch->size);
+
+    if(res && res->size < out_size) {
+        free_chunk(res);
+        res = NULL;
+    }
+    if(res == NULL)
+        res = alloc_chunk(out_size);
+    else
+        out_size = res->size;
+
+    res->num       = ch->num;
+    res->offset    = ch->offset;
+    res->file      = ch->file;
+    res->orig_size = ch->size;
+    res->flags     = CHUNK_CRC;
+    res->crc       = crc32c(0, ch->data, ch->size);
+
+    raw = ch->size >= ENTROPY_MIN_SIZE && chunk_entropy(ch) >= RAW_ENTROPY;
+    if(!raw)
+        res->size = ctx->codec->compress(ctx->state, ch, res->data, out_size);
+    if(raw || res->size >= ch->size) {
+        memcpy(res->data, ch->data, ch->size);
+        res->size  = ch->size;
+        res->flags |= CHUNK_RAW;
+    }
+
+    return res;
+}
+
+// CODEC_ERROR if the data is malformed or does not fit in out_size bytes
+static uint64_t decompress_to(zcontext ctx, chunk ch, unsigned char *out, uint64_t out_size) {
+    if(ch->flags & CHUNK_RAW) {
+        if(ch->size > out_size)
+            return CODEC_ERROR;
+        memcpy(out, ch->data, ch->size);
+        return ch->size;
+    }
+
+    return ctx->codec->decompress(ctx->state, ch, out, out_size);
+}
+
+// Check the data decompressed from ch, size is CODEC_ERROR if the codec failed.
+// Chunks of archives older than version 8 have no checksum, and the last
+// chunk of archives older than version 4 no uncompressed size.
+static int check(chunk ch, unsigned char *data, uint64_t size) {
+    if(size == CODEC_ERROR)
+        return ZCHECK_CORRUPT;
+    if(ch->orig_size && size != ch->orig_size)
+        return ZCHECK_SIZE;
+    if((ch->flags & CHUNK_CRC) && crc32c(0, data, size) != ch->crc)
+        return ZCHECK_CRC;
+    return ZCHECK_OK;
+}
+
+char *zcheck_error(int status) {
+    switch(status) {
+        case ZCHECK_OK:      return "ok";
+        case ZCHECK_CORRUPT: return "cannot be decompressed";
+        case ZCHECK_SIZE:    return "wrong uncompressed size";
+        case ZCHECK_CRC:     return "checksum mismatch";
+        case ZCHECK_READ:    return "cannot be read";
+        default:             return "unknown error";
+    }
+}
+
+static void exit_if_bad(chunk ch, int status) {
+    if(status != ZCHECK_OK) {
+        fprintf(stderr, "Chunk %lu is corrupted (%s)\n", (unsigned long) ch->num, zcheck_error(status));
+        exit(EXIT_FAILURE);
+    }
+}
+
+uint64_t zdecompress_to(zcontext ctx, chunk ch, unsigned char *out, uint64_t out_size) {
+    uint64_t size = decompress_to(ctx, ch, out, out_size);
+
+    exit_if_bad(ch, check(ch, out, size));
+    return size;
+}
+
+// Chunks that record their uncompressed size are decompressed in one pass
+// into a buffer of that size
+chunk zdecompress_ctx(zcontext ctx, chunk ch) {
+    return zdecompress_into(ctx, ch, NULL);
+}
+
+// Decompress ch into res and set status, res->size is 0 if the codec failed
+static chunk decompress_into(zcontext ctx, chunk ch, chunk res, int *status) {
+    int unknown_size = ch->orig_size == 0 && !(ch->flags & CHUNK_RAW);  // an empty raw chunk has orig_size 0
+    uint64_t size;
+
+    if(res && (unknown_size || res->size < ch->orig_size)) {
+        free_chunk(res);
+        res = NULL;
+    }
+
+    if(unknown_size) {
+        if(ctx->codec != &zlib_codec) {
+            fprintf(stderr, "Chunk %lu has no uncompressed size\n", (unsigned long) ch->num);
+            exit(EXIT_FAILURE);
+        }
+        res = malloc(sizeof(*res));
+        res->num    = ch->num;
+        res->offset = ch->offset;
+        res->file   = ch->file;
+        res->flags  = 0;
+        res->crc    = 0;
+        res->mapped = 0;
+        res->pool   = NULL;
+        res->buf_index = -1;
+        size = zlib_decompress_unknown_size(ctx->state, ch, res);
+        *status = check(ch, res->data, size);
+        return res;
+    }
+
+    if(res == NULL)
+        res = alloc_chunk(ch->orig_size);
+
+    size = decompress_to(ctx, ch, res->data, ch->orig_size);
+    *status = check(ch, res->data, size);
+
+    res->num       = ch->num;
+    res->offset    = ch->offset;
+    res->file      = ch->file;
+    res->size      = size == CODEC_ERROR ? 0 : size;
+    res->orig_size = res->size;
+
+    return res;
+}
+
+chunk zdecompress_into(zcontext ctx, chunk ch, chunk res) {
+    int status;
+
+    res = decompress_into(ctx, ch, res, &status);
+    exit_if_bad(ch, status);
+
+    return res;
+}
+
+int zverify(zcontext ctx, chunk ch, chunk *res) {
+    int status;
+
+    *res = decompress_into(ctx, ch, *res, &status);
+
+    return status;
+}
+
+chunk zcompress(chunk ch) {
+    zcontext ctx = zcontext_create(CODEC_ZLIB, -1, -1);
+    chunk res = zcompress_ctx(ctx, ch);
+
+    zcontext_destroy(ctx);
+    return res;
+}
+
+chunk zdecompress(chunk ch) {
+    zcontext ctx = zcontext_create(CODEC_ZLIB, -1, -1);
+    chunk res = zdecompress_ctx(ctx, ch);
+
+    zcontext_destroy(ctx);
+    return res;
+}
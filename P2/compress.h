@@ -3,6 +3,61 @@
 
 #include "chunk_archive.h"
 
+// Codec ids stored in the archive header. zstd and lz4 are only available
+// when built in (make ZSTD=1 LZ4=1).
+#define CODEC_ZLIB 0
+#define CODEC_ZSTD 1
+#define CODEC_LZ4  2
+
+int   codec_by_name(char *name);  // Codec id from its name, -1 if unknown or not built in
+char *codec_name(int codec);      // Name of a codec id
+
+// Levels accepted by a codec. Returns its default level, -1 if not built in
+int   codec_levels(int codec, int *min_level, int *max_level);
+
+// zlib strategy from its name (default, filtered, huffman, rle, fixed), -1 if unknown
+int   strategy_by_name(char *name);
+
+// A compression context keeps the codec state of one thread (the zlib streams,
+// for example) so it can be reused for every chunk that thread processes.
+// A context must not be shared between threads.
+typedef struct _zcontext *zcontext;
+
+// Create a context for a codec, exits if it is not built in. A level or
+// strategy of -1 selects the default of the codec.
+zcontext zcontext_create(int codec, int level, int strategy);
+void     zcontext_destroy(zcontext);  // Release the state of a context
+
+chunk zcompress_ctx(zcontext, chunk);    // Compress a chunk using the state of a context
+chunk zdecompress_ctx(zcontext, chunk);  // Decompress a chunk using the state of a context
+
+// Same, writing the result into the buffer of res (a chunk from a pool, for
+// example) when its size is enough; otherwise res is freed and a new chunk
+// is allocated. res may be NULL.
+chunk zcompress_into(zcontext, chunk ch, chunk res);
+chunk zdecompress_into(zcontext, chunk ch, chunk res);
+
+// Result of checking a decompressed chunk
+#define ZCHECK_OK      0
+#define ZCHECK_CORRUPT 1   // the codec could not decompress the data
+#define ZCHECK_SIZE    2   // the data is not as long as the uncompressed size of the chunk
+#define ZCHECK_CRC     3   // the data does not match the CRC32C of the chunk
+#define ZCHECK_READ    4   // the chunk could not be read from the archive
+
+// Decompress ch into *res like zdecompress_into (*res may be NULL and is
+// replaced if it is too small) and check the data against the uncompressed
+// size and the CRC32C stored with the chunk, when the archive has them.
+// Returns a ZCHECK_ value instead of exiting like zdecompress_into and
+// zdecompress_to do when a chunk is corrupted; (*res)->size is 0 if the
+// codec failed.
+int   zverify(zcontext ctx, chunk ch, chunk *res);
+char *zcheck_error(int status);   // Description of a ZCHECK_ value
+
+uint64_t zcompress_bound(zcontext ctx, uint64_t size);  // Largest compressed size of size bytes
+
+// Decompress a chunk into a caller provided buffer of out_size bytes in a
+// single pass. Returns the size of the decompressed data.
+uint64_t zdecompress_to(zcontext ctx, chunk ch, unsigned char *out, uint64_t out_size);
 
 chunk zcompress(chunk);    // Compress a chunk using zlib
 chunk zdecompress(chunk);  // Decompress a chunk using zlib
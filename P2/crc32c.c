@@ -0,0 +1,141 @@
+#include <string.h>
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#define POLY 0x82f63b78U   // Castagnoli polynomial, bit reversed
+
+static uint32_t table[8][256];   // slicing by 8: table[k][b] is the CRC of b followed by k zero bytes
+
+static uint32_t (*update)(uint32_t crc, const unsigned char *p, size_t n);
+static char *impl;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static uint32_t update_table(uint32_t crc, const unsigned char *p, size_t n) {
+    while (n > 0 && ((uintptr_t) p & 7)) {
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        n--;
+    }
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__   // the words are sliced in memory order
+    while (n >= 8) {
+        uint32_t lo, hi;
+
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+#endif
+
+    while (n-- > 0)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t update_hw(uint32_t crc, const unsigned char *p, size_t n) {
+    uint64_t c = crc;
+
+    while (n > 0 && ((uintptr_t) p & 7)) {
+        c = _mm_crc32_u8(c, *p++);
+        n--;
+    }
+
+    while (n >= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+        p += 8;
+        n -= 8;
+    }
+
+    while (n-- > 0)
+        c = _mm_crc32_u8(c, *p++);
+
+    return c;
+}
+
+static int have_hw(void) {
+    return __builtin_cpu_supports("sse4.2");
+}
+#define HW_NAME "sse4.2"
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t update_hw(uint32_t crc, const unsigned char *p, size_t n) {
+    while (n > 0 && ((uintptr_t) p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        n--;
+    }
+
+    while (n >= 8) {
+        uint64_t w;
+
+        memcpy(&w, p, 8);
+        crc = __crc32cd(crc, w);
+        p += 8;
+        n -= 8;
+    }
+
+    while (n-- > 0)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static int have_hw(void) {
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#define HW_NAME "armv8"
+#endif
+
+// Build the tables and pick the implementation, once per process
+static void init(void) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+
+        for (int k = 0; k < 8; k++)
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        table[0][b] = crc;
+    }
+
+    for (int b = 0; b < 256; b++)
+        for (int k = 1; k < 8; k++)
+            table[k][b] = table[0][table[k - 1][b] & 0xff] ^ (table[k - 1][b] >> 8);
+
+    update = update_table;
+    impl   = "table";
+#ifdef HW_NAME
+    if (have_hw()) {
+        update = update_hw;
+        impl   = HW_NAME;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+    pthread_once(&once, init);
+
+    return ~update(~crc, buf, n);
+}
+
+char *crc32c_impl(void) {
+    pthread_once(&once, init);
+
+    return impl;
+}
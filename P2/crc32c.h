@@ -0,0 +1,16 @@
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C (Castagnoli polynomial) of the data of the chunks. The CRC
+// instructions of SSE 4.2 (x86-64) or ARMv8 are used when the processor has
+// them, and a table driven version otherwise.
+
+// Extend crc, the CRC32C of the data before buf (0 for none), with n bytes of buf
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
+
+char    *crc32c_impl(void);   // Name of the implementation in use: sse4.2, armv8 or table
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include "extract.h"
+#include "compress.h"
+
+// Last chunk of first to last-1 that starts at or before off. file_offset
+// grows with the chunk number within a file, since chunks are numbered in
+// the order they are read; it starts again at 0 for every file of a container.
+static uint64_t find_chunk(archive ar, uint64_t first, uint64_t last, uint64_t off) {
+    uint64_t lo = first, hi = last;
+
+    while(hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if(ar->file_offset[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// Uncompressed size of chunk i of a file that ends before chunk last, 0 if
+// the archive does not record it (the last chunk of archives older than version 4)
+static uint64_t chunk_orig_size(archive ar, uint64_t i, uint64_t last) {
+    if(ar->orig_size[i])
+        return ar->orig_size[i];
+    if(i + 1 < last)
+        return ar->file_offset[i + 1] - ar->file_offset[i];
+    return 0;
+}
+
+void archive_set_cache(archive ar, chunk_cache c) {
+    ar->cache = c;
+}
+
+uint64_t archive_read_range(archive ar, uint64_t off, uint64_t len, unsigned char *buf) {
+    return archive_read_file_range(ar, 0, ar->chunks, off, len, buf);
+}
+
+uint64_t archive_read_file_range(archive ar, uint64_t first, uint64_t count, uint64_t off, uint64_t len, unsigned char *buf) {
+    uint64_t done = 0, last = first + count;
+    zcontext ctx;
+
+    if(count == 0 || len == 0)
+        return 0;
+
+    ctx = NULL;
+
+    for(uint64_t i = find_chunk(ar, first, last, off); i < last && done < len; i++) {
+        uint64_t start = ar->file_offset[i];
+        uint64_t size  = chunk_orig_size(ar, i, last);
+        uint64_t pos   = off + done;
+        int64_t cached;
+        chunk ch;
+
+        if(ar->cache && (cached = cache_read(ar->cache, ar, i, pos - start, len - done, buf + done)) >= 0) {
+            done += cached;
+            continue;
+        }
+
+        if(ctx == NULL)                           // only created when a chunk has to be decompressed
+            ctx = zcontext_create(ar->codec, -1, -1);
+
+        ch = get_chunk(ar, i);
+        ch->orig_size = size;
+
+        if(size && start == pos && size <= len - done && ar->cache == NULL) {
+            // the whole chunk is in the range, it is decompressed in place
+            done += zdecompress_to(ctx, ch, buf + done, size);
+        } else {
+            chunk res = zdecompress_ctx(ctx, ch);
+
+            if(pos < start + res->size) {
+                uint64_t n = start + res->size - pos;
+
+                if(n > len - done)
+                    n = len - done;
+                memcpy(buf + done, res->data + (pos - start), n);
+                done += n;
+            }
+            if(ar->cache)
+                cache_insert(ar->cache, ar, res);
+            else
+                free_chunk(res);
+        }
+        free_chunk(ch);
+    }
+
+    if(ctx)
+        zcontext_destroy(ctx);
+
+    return done;
+}
@@ -0,0 +1,26 @@
+#ifndef __EXTRACT_H__
+#define __EXTRACT_H__
+
+#include "chunk_archive.h"
+#include "chunk_cache.h"
+
+// Random access to the original file of an archive opened with
+// open_archive_file (streams have no index and cannot be used).
+
+// Copy len bytes of the original file starting at offset off into buf.
+// Only the chunks that cover the range are read and decompressed.
+// Returns the number of bytes copied, less than len if the range goes
+// past the end of the file. Several threads can read ranges of the same
+// archive at once.
+uint64_t archive_read_range(archive ar, uint64_t off, uint64_t len, unsigned char *buf);
+
+// Same as archive_read_range for the file of a container archive held in
+// chunks first to first+count-1 (see find_archive_file); off is an offset
+// in that file.
+uint64_t archive_read_file_range(archive ar, uint64_t first, uint64_t count, uint64_t off, uint64_t len, unsigned char *buf);
+
+// Keep the chunks decompressed by archive_read_range in c, so later reads of
+// the same chunks are copied from memory. The cache must outlive the archive.
+void archive_set_cache(archive ar, chunk_cache c);
+
+#endif
@@ -1,118 +1,236 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
-#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define CACHE_LINE 64
+
+// Bounded multi-producer/multi-consumer ring. Each slot carries a sequence
+// number: seq == pos means the slot is free for the producer at pos,
+// seq == pos+1 means it holds the element for the consumer at pos.
+// Producers and consumers only block on a futex when the ring is full or empty.
+typedef struct {
+    _Atomic size_t seq;
+    void *data;
+} slot;
+
+// futex word bumped on every wakeup, with the number of threads sleeping on it
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic int waiters;
+} event;
 
 typedef struct _queue {
-    int size;
-    int used;
-    int first;
-    void **data;
-    pthread_mutex_t mutex;
-    pthread_cond_t non_full;
-    pthread_cond_t non_empty;
+    _Alignas(CACHE_LINE) _Atomic size_t tail;   // next position to insert
+    _Alignas(CACHE_LINE) _Atomic size_t head;   // next position to remove
+    _Alignas(CACHE_LINE) event non_full;
+    _Alignas(CACHE_LINE) event non_empty;
+    _Alignas(CACHE_LINE) size_t size;
+    slot *slots;
 } _queue;
 
 #include "new_queue.h"
 
+static void event_wait(event *ev, uint32_t seq) {
+    syscall(SYS_futex, &ev->seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+}
+
+static void event_signal(event *ev, int n) {
+    // pairs with the fence in the waiting thread: either it sees the new
+    // element or slot, or we see it waiting
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ev->waiters, memory_order_relaxed) == 0)
+        return;
+
+    atomic_fetch_add_explicit(&ev->seq, 1, memory_order_release);
+    syscall(SYS_futex, &ev->seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
 queue q_create(int size) {
-    queue q = malloc(sizeof(_queue));
+    queue q = aligned_alloc(CACHE_LINE, sizeof(_queue));
     if (q == NULL) {
         perror("Error allocating memory for queue");
         exit(EXIT_FAILURE);
     }
 
-    q->size = size;
-    q->used = 0;
-    q->first = 0;
-    q->data = malloc(size * sizeof(void *));
-    if (q->data == NULL) {
+    q->size = size < 2 ? 2 : size;   // with one slot, full and free have the same sequence number
+    q->slots = malloc(q->size * sizeof(slot));
+    if (q->slots == NULL) {
         perror("Error allocating memory for queue data");
         exit(EXIT_FAILURE);
     }
 
-    if (pthread_mutex_init(&q->mutex, NULL) != 0) {
-        perror("Error initializing mutex");
-        exit(EXIT_FAILURE);
-    }
-
-    if (pthread_cond_init(&q->non_full, NULL) != 0) {
-        perror("Error initializing non_full condition variable");
-        exit(EXIT_FAILURE);
-    }
+    for (size_t i = 0; i < q->size; i++)
+        atomic_init(&q->slots[i].seq, i);
 
-    if (pthread_cond_init(&q->non_empty, NULL) != 0) {
-        perror("Error initializing non_empty condition variable");
-        exit(EXIT_FAILURE);
-    }
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->head, 0);
+    atomic_init(&q->non_full.seq, 0);
+    atomic_init(&q->non_full.waiters, 0);
+    atomic_init(&q->non_empty.seq, 0);
+    atomic_init(&q->non_empty.waiters, 0);
 
     return q;
 }
 
 int q_elements(queue q) {
-    pthread_mutex_lock(&q->mutex);
-    int elements = q->used;
-    pthread_mutex_unlock(&q->mutex);
-    return elements;
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    return tail > head ? tail - head : 0;
 }
 
-int q_insert(queue q, void *elem) {
-    pthread_mutex_lock(&q->mutex);
+// Claim up to n consecutive free slots with a single CAS on tail and fill
+// them. Returns the number of elements inserted, 0 if the queue is full.
+static int try_insert(queue q, void **elems, int n) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+
+    for (;;) {
+        int k = 0;
+
+        while (k < n && k < (int) q->size &&
+               atomic_load_explicit(&q->slots[(pos + k) % q->size].seq, memory_order_acquire) == pos + k)
+            k++;
+
+        if (k == 0) {
+            size_t seq = atomic_load_explicit(&q->slots[pos % q->size].seq, memory_order_acquire);
+            if ((intptr_t) seq - (intptr_t) pos < 0)
+                return 0;
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+            continue;
+        }
 
-    while (q->used == q->size) {
-        pthread_cond_wait(&q->non_full, &q->mutex);
+        if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + k,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            for (int i = 0; i < k; i++) {
+                slot *s = &q->slots[(pos + i) % q->size];
+                s->data = elems[i];
+                atomic_store_explicit(&s->seq, pos + i + 1, memory_order_release);
+            }
+            return k;
+        }
     }
+}
 
-    q->data[(q->first + q->used) % q->size] = elem;
-    q->used++;
+// Claim up to n consecutive full slots with a single CAS on head and empty
+// them. Returns the number of elements removed, 0 if the queue is empty.
+static int try_remove(queue q, void **elems, int n) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
 
-    pthread_cond_signal(&q->non_empty);
-    pthread_mutex_unlock(&q->mutex);
+    for (;;) {
+        int k = 0;
+
+        while (k < n && k < (int) q->size &&
+               atomic_load_explicit(&q->slots[(pos + k) % q->size].seq, memory_order_acquire) == pos + k + 1)
+            k++;
+
+        if (k == 0) {
+            size_t seq = atomic_load_explicit(&q->slots[pos % q->size].seq, memory_order_acquire);
+            if ((intptr_t) seq - (intptr_t) (pos + 1) < 0)
+                return 0;
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+            continue;
+        }
 
-    return 1;
+        if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + k,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            for (int i = 0; i < k; i++) {
+                slot *s = &q->slots[(pos + i) % q->size];
+                elems[i] = s->data;
+                atomic_store_explicit(&s->seq, pos + i + q->size, memory_order_release);
+            }
+            return k;
+        }
+    }
 }
 
-void *q_remove(queue q) {
-    void *res;
-    pthread_mutex_lock(&q->mutex);
+// Insert all n elements, waiting for free slots when the queue is full.
+// Consumers are woken once per batch of elements that fit.
+int q_insert_many(queue q, void **elems, int n) {
+    int done = 0;
+
+    while (done < n) {
+        int k = try_insert(q, elems + done, n - done);
 
-    while (q->used == 0) {
-        pthread_cond_wait(&q->non_empty, &q->mutex);
+        if (k == 0) {
+            uint32_t seq = atomic_load_explicit(&q->non_full.seq, memory_order_acquire);
+            atomic_fetch_add_explicit(&q->non_full.waiters, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+
+            k = try_insert(q, elems + done, n - done);
+            if (k == 0)
+                event_wait(&q->non_full, seq);
+            atomic_fetch_sub_explicit(&q->non_full.waiters, 1, memory_order_relaxed);
+        }
+
+        if (k > 0) {
+            done += k;
+            event_signal(&q->non_empty, k);
+        }
     }
 
-    res = q->data[q->first];
-    q->first = (q->first + 1) % q->size;
-    q->used--;
+    return n;
+}
 
-    pthread_cond_signal(&q->non_full);
-    pthread_mutex_unlock(&q->mutex);
+// Remove between 1 and n elements, waiting while the queue is empty.
+// Returns the number of elements stored in elems.
+int q_remove_up_to(queue q, void **elems, int n) {
+    int k;
+
+    while ((k = try_remove(q, elems, n)) == 0) {
+        uint32_t seq = atomic_load_explicit(&q->non_empty.seq, memory_order_acquire);
+        atomic_fetch_add_explicit(&q->non_empty.waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+
+        k = try_remove(q, elems, n);
+        if (k == 0)
+            event_wait(&q->non_empty, seq);
+        atomic_fetch_sub_explicit(&q->non_empty.waiters, 1, memory_order_relaxed);
+        if (k > 0)
+            break;
+    }
+
+    event_signal(&q->non_full, k);
+
+    return k;
+}
+
+int q_insert(queue q, void *elem) {
+    return q_insert_many(q, &elem, 1);
+}
+
+void *q_remove(queue q) {
+    void *res;
+
+    q_remove_up_to(q, &res, 1);
 
     return res;
 }
 
 void q_destroy(queue q) {
-    pthread_mutex_lock(&q->mutex);
-    free(q->data);
-    pthread_mutex_unlock(&q->mutex);
-    pthread_mutex_destroy(&q->mutex);
-    pthread_cond_destroy(&q->non_full);
-    pthread_cond_destroy(&q->non_empty);
+    free(q->slots);
     free(q);
 }
 
+// Not thread safe, for debugging only
 void q_print(queue q) {
-    pthread_mutex_lock(&q->mutex);
+    size_t head = atomic_load(&q->head), tail = atomic_load(&q->tail);
+
     printf("Elementos actuales de la cola: ");
-    if (q->used == 0) {
+    if (head == tail) {
         printf("La cola está vacía\n");
     } else {
-        int i;
-        for (i = 0; i < q->used; i++) {
-            printf("%d", *((int *)q->data[(q->first + i) % q->size]));
-            if (i < q->used - 1) {
+        for (size_t i = head; i < tail; i++) {
+            printf("%d", *((int *)q->slots[i % q->size].data));
+            if (i < tail - 1) {
                 printf(" ");
             }
         }
         printf("\n");
     }
-    pthread_mutex_unlock(&q->mutex);
 }
@@ -7,6 +7,8 @@ queue q_create(int size);            // Create a new queue
 int   q_elements(queue q);           // Number of elements in a queue
 int   q_insert(queue q, void *elem); // Insert an element into a queue
 void *q_remove(queue q);             // Remove an element from the queue
+int   q_insert_many(queue q, void **elems, int n);   // Insert n elements, waiting for space
+int   q_remove_up_to(queue q, void **elems, int n);  // Remove 1 to n elements, returns how many
 void  q_destroy(queue q);            // Destroy a queue
 void  q_print(queue q);              // Print the current elements in the queue
 
@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "options.h"
+#include "compress.h"
 
 static struct option long_options[] = {
 	{ .name = "threads",
@@ -25,6 +26,74 @@ static struct option long_options[] = {
 	  .has_arg = required_argument,
 	  .flag = NULL,
 	  .val = 'd'},
+	{ .name = "codec",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'z'},
+	{ .name = "level",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'l'},
+	{ .name = "strategy",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'S'},
+	{ .name = "no-mmap",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'M'},
+	{ .name = "ordered",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'O'},
+	{ .name = "auto-size",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'A'},
+	{ .name = "io-uring",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'U'},
+	{ .name = "range",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'R'},
+	{ .name = "cache",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'K'},
+	{ .name = "cache-stats",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'Y'},
+	{ .name = "test",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'T'},
+	{ .name = "verify",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'T'},
+	{ .name = "recursive",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'r'},
+	{ .name = "container",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'C'},
+	{ .name = "name",
+	  .has_arg = required_argument,
+	  .flag = NULL,
+	  .val = 'N'},
+	{ .name = "list",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'L'},
+	{ .name = "bench",
+	  .has_arg = no_argument,
+	  .flag = NULL,
+	  .val = 'b'},
     { .name = "out",
 	  .has_arg = required_argument,
 	  .flag = NULL,
@@ -39,19 +108,69 @@ static struct option long_options[] = {
 static void usage(int i)
 {
 	printf(
-		"Usage:  comp [-c | -d] [OPTIONS] FILE\n"
+		"Usage:  comp [-c | -d | -b | --test | --list] [OPTIONS] FILE\n"
+		"        comp -c [OPTIONS] FILE...\n"
+		"        comp -c --container -o ARCHIVE [OPTIONS] FILE...\n"
 		"Options:\n"
-        "  -c,       --compress       compress FILE\n"
-		"  -d,       --decompress     decompress FILE\n"
+        "  -c,       --compress       compress FILE, or every FILE into its own FILE.ch\n"
+		"  -r,       --recursive      compress the files in the directories given and their\n"
+		"                             subdirectories (except .ch archives)\n"
+		"            --container      store every FILE in one archive (-o) with a directory\n"
+		"  -d,       --decompress     decompress FILE, or every file of a container archive\n"
+		"            --name=NAME      decompress only the file NAME of a container archive\n"
+		"            --list           list the files of the container archive FILE\n"
+		"  -b,       --bench          report ratio and speed of every level on a sample of FILE\n"
+		"            --test           decompress every chunk of the archive FILE in memory on -t\n"
+		"                             threads and report the bad ones, without writing the data\n"
+		"            --verify         same as --test\n"
         "  -q n,     --queue_size=n   size of the work queue\n"
 		"  -t n,     --threads=n      number of threads\n"
 		"  -s n,     --size=n         size of each chunk\n"
-        "  -o ofile, --out=ofile      name of the output file\n"
+        "  -o ofile, --out=ofile      name of the output file, - for stdout\n"
+		"  -z name,  --codec=name     compression codec: zlib (default), zstd, lz4\n"
+		"  -l n,     --level=n        compression level (zlib 1-9, zstd 1-19)\n"
+		"            --strategy=name  zlib strategy: default, filtered, huffman, rle, fixed\n"
+		"            --no-mmap        read FILE with read() instead of mapping it\n"
+		"            --ordered        store the chunks in the archive in chunk order\n"
+		"            --range=START:LEN  decompress LEN bytes from offset START (to stdout without -o),\n"
+		"                             can be repeated and the ranges are written one after another\n"
+		"            --cache=BYTES    keep up to BYTES of decompressed chunks in memory, so ranges\n"
+		"                             that share chunks only decompress them once\n"
+		"            --cache-stats    report the hits and misses of --cache on stderr\n"
+		"            --auto-size      adapt the chunk size (64 KiB to 4 MiB) to how fast and how well\n"
+		"                             FILE compresses, starting from -s\n"
+		"            --io-uring       keep several reads and writes in flight with io_uring\n"
+		"                             (read() and write() are used if it is not available)\n"
 		"  -h,       --help           this message\n\n"
+		"FILE - reads from stdin and writes to stdout unless -o is given\n"
 	);
 	exit(i);
 }
 
+// START:LEN, both unsigned decimal integers
+static int get_range(char *arg, uint64_t *start, uint64_t *len)
+{
+	char *end;
+
+	*start = strtoull(arg, &end, 10);
+	if (end == arg || *end != ':')
+		return 0;
+
+	arg = end + 1;
+	*len = strtoull(arg, &end, 10);
+
+	return end != arg && *end == '\0';
+}
+
+static int get_uint64(char *arg, uint64_t *value)
+{
+	char *end;
+
+	*value = strtoull(arg, &end, 10);
+
+	return end != arg && *end == '\0';
+}
+
 static int get_int(char *arg, int *value)
 {
 	char *end;
@@ -66,7 +185,7 @@ int handle_options(int argc, char **argv, struct options *opt)
 		int c;
 		int option_index = 0;
 
-		c = getopt_long (argc, argv, "hcdq:t:o:s:",
+		c = getopt_long (argc, argv, "hcdbrq:t:o:s:z:l:",
 				 long_options, &option_index);
 		if (c == -1)
 			break;
@@ -98,15 +217,91 @@ int handle_options(int argc, char **argv, struct options *opt)
 			}
 			break;
 		case 'c':
-            opt->compress=1;
+            opt->compress=COMPRESS;
 			break;
 
 		case 'd':
-            opt->compress=0;
+            opt->compress=DECOMPRESS;
 			break;
         case 'o':
             opt->out_file=optarg;
             break;
+		case 'l':
+			if (!get_int(optarg, &opt->level)
+			    || opt->level < 0) {
+				printf("'%s': is not a valid integer\n",
+				       optarg);
+				usage(-3);
+			}
+			break;
+		case 'S':
+			if ((opt->strategy = strategy_by_name(optarg)) < 0) {
+				printf("'%s': is not a valid strategy\n",
+				       optarg);
+				usage(-3);
+			}
+			break;
+		case 'M':
+			opt->use_mmap=0;
+			break;
+		case 'O':
+			opt->ordered=1;
+			break;
+		case 'A':
+			opt->auto_size=1;
+			break;
+		case 'U':
+			opt->uring=1;
+			break;
+		case 'r':
+			opt->recursive=1;
+			break;
+		case 'R':
+			if (opt->range == MAX_RANGES) {
+				printf("--range can be given at most %d times\n",
+				       MAX_RANGES);
+				usage(-3);
+			}
+			if (!get_range(optarg, &opt->range_start[opt->range],
+				       &opt->range_len[opt->range])) {
+				printf("'%s': is not a valid range\n",
+				       optarg);
+				usage(-3);
+			}
+			opt->range++;
+			break;
+		case 'K':
+			if (!get_uint64(optarg, &opt->cache_size)) {
+				printf("'%s': is not a valid size\n",
+				       optarg);
+				usage(-3);
+			}
+			break;
+		case 'Y':
+			opt->cache_stats=1;
+			break;
+		case 'C':
+			opt->container=1;
+			break;
+		case 'N':
+			opt->name=optarg;
+			break;
+		case 'L':
+			opt->compress=LIST;
+			break;
+		case 'b':
+            opt->compress=BENCHMARK;
+			break;
+		case 'T':
+			opt->compress=TEST;
+			break;
+		case 'z':
+			if ((opt->codec = codec_by_name(optarg)) < 0) {
+				printf("'%s': is not an available codec\n",
+				       optarg);
+				usage(-3);
+			}
+			break;
 		case '?':
 		case 'h':
 			usage(0);
@@ -123,6 +318,8 @@ int handle_options(int argc, char **argv, struct options *opt)
         exit(0);
     } else {
         opt->file=argv[optind];
+        opt->files=&argv[optind];
+        opt->nfiles=argc-optind;
     }
 
 	return 0;
@@ -135,7 +332,59 @@ int read_options(int argc, char **argv, struct options *opt) {
 	if (result != 0)
 		exit(result);
 
-	if (argc - optind > 1) {
+	if (opt->recursive && opt->compress != COMPRESS) {
+		printf("-r can only be used to compress\n");
+		usage(-2);
+	}
+
+	if (opt->level >= 0) {
+		int min_level, max_level;
+
+		codec_levels(opt->codec, &min_level, &max_level);
+		if (opt->level < min_level || opt->level > max_level) {
+			printf("Level %d is not valid for %s (%d-%d)\n",
+			       opt->level, codec_name(opt->codec), min_level, max_level);
+			usage(-3);
+		}
+	}
+
+	if (opt->container && (opt->compress != COMPRESS || opt->out_file == NULL)) {
+		printf("--container needs -c and -o\n");
+		usage(-2);
+	}
+
+	if (opt->name && opt->compress != DECOMPRESS) {
+		printf("--name can only be used to decompress\n");
+		usage(-2);
+	}
+
+	if (opt->range && opt->compress != DECOMPRESS) {
+		printf("--range can only be used to decompress\n");
+		usage(-2);
+	}
+
+	if ((opt->cache_size || opt->cache_stats) && !opt->range) {
+		printf("--cache and --cache-stats need --range\n");
+		usage(-2);
+	}
+
+	if (opt->cache_stats && !opt->cache_size) {
+		printf("--cache-stats needs --cache\n");
+		usage(-2);
+	}
+
+	if (opt->compress == COMPRESS && (opt->nfiles > 1 || opt->container)) {
+		for (int i = 0; i < opt->nfiles; i++)
+			if (!strcmp(opt->files[i], "-")) {
+				printf(opt->container ? "- cannot be stored in a container\n"
+				                      : "- cannot be compressed with other files\n");
+				usage(-2);
+			}
+		if (opt->out_file && !opt->container) {
+			printf("-o cannot be used with several files\n");
+			usage(-2);
+		}
+	} else if (argc - optind > 1) {
 		printf ("Too many arguments\n\n");
 		while (optind < argc)
 			printf ("'%s' ", argv[optind++]);
@@ -1,12 +1,40 @@
 #ifndef __OPTIONS_H__
 #define __OPTIONS_H__
 
+#include <stdint.h>
+
+// what comp does, in compress
+#define DECOMPRESS 0
+#define COMPRESS   1
+#define BENCHMARK  2
+#define TEST       3
+#define LIST       4
+
+#define MAX_RANGES 64         // --range can be given up to MAX_RANGES times
+
 struct options {
-    int compress;
+    int compress;             // COMPRESS, DECOMPRESS, BENCHMARK, TEST or LIST
     int num_threads;
     int size;
     int queue_size;
-    char *file;
+    int codec;
+    int level;
+    int strategy;
+    int use_mmap;
+    int ordered;
+    int uring;                // read and write with io_uring if the kernel supports it
+    int auto_size;            // adapt the chunk size to the compression speed, starting from size
+    int range;                // number of ranges, decompress only range_len[i] bytes from range_start[i]
+    uint64_t range_start[MAX_RANGES];
+    uint64_t range_len[MAX_RANGES];
+    uint64_t cache_size;      // budget of the cache of decompressed chunks for the ranges (0 for none)
+    int cache_stats;          // report the hits and misses of the cache
+    int recursive;            // compress the files in the directories of files, and their subdirectories
+    int container;            // store every input file in the out_file archive, with a directory
+    char *name;               // file of a container archive to decompress (NULL for all)
+    char *file;               // files[0]
+    char **files;             // input files, several only when compressing
+    int nfiles;
     char *out_file;
 };
 
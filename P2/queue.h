@@ -7,6 +7,8 @@ queue q_create(int size);            // Create a new queue
 int   q_elements(queue q);           // number of elements in a queue
 int   q_insert(queue q, void *elem); // insert an element into a queue
 void *q_remove(queue q);             // remove an element from the queue
+int   q_insert_many(queue q, void **elems, int n);   // insert n elements, waiting for space
+int   q_remove_up_to(queue q, void **elems, int n);  // remove 1 to n elements, returns how many
 void  q_destroy(queue q);            // destroy a queue
 
 #endif
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "task_pool.h"
+
+#define CACHE_LINE     64
+#define DEQUE_SIZE     64     // initial tasks of a deque, it grows when full
+#define STEAL_MAX      256    // most tasks moved by one steal
+
+typedef struct {
+    task_fn fn;
+    void *arg;
+} task;
+
+// Ring of tasks: the owner takes them from head, thieves from the back.
+// Each deque has its own lock and cache line, workers only share a lock
+// when one of them steals. count is only changed with the lock held, but it
+// is atomic because thieves peek at it without the lock.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;
+    task *tasks;
+    unsigned size, head;
+    _Atomic unsigned count;
+} deque;
+
+typedef struct {
+    task_pool pool;
+    int id;
+} worker_arg;
+
+typedef struct _task_pool {
+    int threads;
+    pthread_t *ids;
+    worker_arg *args;
+    deque *deques;
+    _Alignas(CACHE_LINE) _Atomic unsigned next;  // deque for the next task submitted from outside
+    _Alignas(CACHE_LINE) _Atomic int queued;     // tasks in the deques
+    _Atomic int sleeping;                        // workers waiting on wake
+    int stop;
+    pthread_mutex_t mutex;                       // only taken to sleep and to wake workers
+    pthread_cond_t wake;
+} _task_pool;
+
+// pool and worker number of the calling thread, if it is a worker
+static __thread task_pool self_pool;
+static __thread int self_id;
+
+static void deque_push(deque *d, task *t, unsigned n) {
+    pthread_mutex_lock(&d->mutex);
+
+    if (d->count + n > d->size) {                // grow, unwrapping the ring
+        unsigned size = d->size;
+        task *tasks;
+
+        while (d->count + n > size)
+            size *= 2;
+        tasks = malloc(size * sizeof(task));
+        if (tasks == NULL) {
+            perror("Error allocating memory for task pool");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned i = 0; i < d->count; i++)
+            tasks[i] = d->tasks[(d->head + i) % d->size];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->size  = size;
+        d->head  = 0;
+    }
+
+    for (unsigned i = 0; i < n; i++)
+        d->tasks[(d->head + d->count + i) % d->size] = t[i];
+    d->count += n;
+
+    pthread_mutex_unlock(&d->mutex);
+}
+
+static int deque_pop(deque *d, task *t) {
+    int found = 0;
+
+    pthread_mutex_lock(&d->mutex);
+    if (d->count > 0) {
+        *t = d->tasks[d->head];
+        d->head = (d->head + 1) % d->size;
+        d->count--;
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->mutex);
+
+    return found;
+}
+
+// Take half of the tasks at the back of d (at least one), in submission order
+static unsigned deque_steal(deque *d, task *t) {
+    unsigned n;
+
+    pthread_mutex_lock(&d->mutex);
+    n = (d->count + 1) / 2;
+    if (n > STEAL_MAX)
+        n = STEAL_MAX;
+    d->count -= n;
+    for (unsigned i = 0; i < n; i++)
+        t[i] = d->tasks[(d->head + d->count + i) % d->size];
+    pthread_mutex_unlock(&d->mutex);
+
+    return n;
+}
+
+// Look for work in the other deques, starting after our own. The first
+// stolen task is returned and the rest are moved to the deque of id.
+static int steal(task_pool p, int id, task *t) {
+    task stolen[STEAL_MAX];
+
+    for (int i = 1; i < p->threads; i++) {
+        deque *victim = &p->deques[(id + i) % p->threads];
+        unsigned n;
+
+        // checked without the lock: a deque that looks empty is skipped
+        if (atomic_load_explicit(&victim->count, memory_order_relaxed) == 0)
+            continue;
+
+        if ((n = deque_steal(victim, stolen)) == 0)
+            continue;
+
+        *t = stolen[0];
+        if (n > 1)
+            deque_push(&p->deques[id], stolen + 1, n - 1);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void *worker(void *arg) {
+    worker_arg *w = arg;
+    task_pool p = w->pool;
+    int id = w->id;
+    task t;
+
+    self_pool = p;
+    self_id   = id;
+
+    while (1) {
+        if (deque_pop(&p->deques[id], &t) || steal(p, id, &t)) {
+            atomic_fetch_sub(&p->queued, 1);
+            t.fn(t.arg, id);
+            continue;
+        }
+
+        // sleeping is raised before queued is checked, and submitters raise
+        // queued before they check sleeping: one of the two sees the other
+        pthread_mutex_lock(&p->mutex);
+        atomic_fetch_add(&p->sleeping, 1);
+        while (atomic_load(&p->queued) == 0 && !p->stop)
+            pthread_cond_wait(&p->wake, &p->mutex);
+        atomic_fetch_sub(&p->sleeping, 1);
+        if (p->stop && atomic_load(&p->queued) == 0) {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    return NULL;
+}
+
+task_pool task_pool_create(int threads) {
+    task_pool p = aligned_alloc(CACHE_LINE, sizeof(_task_pool));
+    if (p == NULL) {
+        perror("Error allocating memory for task pool");
+        exit(EXIT_FAILURE);
+    }
+
+    p->threads = threads;
+    p->ids     = malloc(threads * sizeof(pthread_t));
+    p->args    = malloc(threads * sizeof(worker_arg));
+    p->deques  = aligned_alloc(CACHE_LINE, threads * sizeof(deque));
+    if (p->ids == NULL || p->args == NULL || p->deques == NULL) {
+        perror("Error allocating memory for task pool");
+        exit(EXIT_FAILURE);
+    }
+
+    atomic_init(&p->next, 0);
+    atomic_init(&p->queued, 0);
+    atomic_init(&p->sleeping, 0);
+    p->stop = 0;
+
+    if (pthread_mutex_init(&p->mutex, NULL) != 0 || pthread_cond_init(&p->wake, NULL) != 0) {
+        perror("Error initializing task pool");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        deque *d = &p->deques[i];
+
+        pthread_mutex_init(&d->mutex, NULL);
+        d->tasks = malloc(DEQUE_SIZE * sizeof(task));
+        d->size  = DEQUE_SIZE;
+        d->head  = 0;
+        d->count = 0;
+        if (d->tasks == NULL) {
+            perror("Error allocating memory for task pool");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        p->args[i].pool = p;
+        p->args[i].id   = i;
+        if (pthread_create(&p->ids[i], NULL, worker, &p->args[i]) != 0) {
+            perror("Error creating task pool thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    return p;
+}
+
+int task_pool_threads(task_pool p) {
+    return p->threads;
+}
+
+void task_pool_submit(task_pool p, task_fn fn, void *arg) {
+    task t = { fn, arg };
+    int id = self_pool == p ? self_id : (int) (atomic_fetch_add(&p->next, 1) % p->threads);
+
+    atomic_fetch_add(&p->queued, 1);
+    deque_push(&p->deques[id], &t, 1);
+
+    if (atomic_load(&p->sleeping) > 0) {
+        pthread_mutex_lock(&p->mutex);
+        pthread_cond_signal(&p->wake);
+        pthread_mutex_unlock(&p->mutex);
+    }
+}
+
+void task_pool_destroy(task_pool p) {
+    pthread_mutex_lock(&p->mutex);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (int i = 0; i < p->threads; i++)
+        pthread_join(p->ids[i], NULL);
+
+    for (int i = 0; i < p->threads; i++) {
+        pthread_mutex_destroy(&p->deques[i].mutex);
+        free(p->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->wake);
+    free(p->deques);
+    free(p->ids);
+    free(p->args);
+    free(p);
+}
@@ -0,0 +1,23 @@
+#ifndef __TASK_POOL_H__
+#define __TASK_POOL_H__
+
+// A fixed set of worker threads that run submitted tasks. Every worker has
+// its own deque of tasks: tasks submitted from outside the pool are spread
+// over the deques in turn, and tasks submitted by a running task go to the
+// deque of its worker. A worker takes tasks from the front of its deque in
+// the order they were submitted; when it is empty it steals half of the
+// tasks at the back of the deque of another worker, and sleeps only when
+// every deque is empty. The pool can be shared by any number of producers
+// and is meant to live as long as the process.
+typedef struct _task_pool *task_pool;
+
+// A task gets the argument it was submitted with and the number of the
+// worker running it (0 to threads-1), to keep per worker state
+typedef void (*task_fn)(void *arg, int worker);
+
+task_pool task_pool_create(int threads);    // Start a pool of threads workers
+int       task_pool_threads(task_pool p);   // Number of workers of the pool
+void      task_pool_submit(task_pool p, task_fn fn, void *arg);  // Run fn(arg, worker) on some worker, never waits
+void      task_pool_destroy(task_pool p);   // Run the tasks left, then stop the workers
+
+#endif
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+
+// io_uring without liburing: the rings are mapped and driven with the
+// system calls directly. The kernel consumes the submission ring and fills
+// the completion ring, the indexes shared with it are read with acquire
+// and written with release.
+typedef struct _uring {
+    int fd;
+    unsigned depth;
+    unsigned pending;             // prepared and not yet completed
+    unsigned queued;              // prepared and not yet submitted
+    unsigned buffers;             // registered buffers
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+} _uring;
+
+static int enter(uring r, unsigned submit, unsigned wait) {
+    return syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+// The ring is only used if the kernel has every operation sent to it.
+// IORING_OP_READ and IORING_OP_WRITE need Linux 5.6; older kernels create
+// the ring but fail each request with -EINVAL. They have no
+// IORING_REGISTER_PROBE either, so a failed probe also means no io_uring.
+static int supports_ops(int fd) {
+    static const int ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED,
+                               IORING_OP_WRITE_FIXED, IORING_OP_WRITEV };
+    unsigned n = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + n * sizeof(struct io_uring_probe_op));
+    int ok = 1;
+
+    if (probe == NULL) {
+        perror("Error allocating memory for io_uring");
+        exit(EXIT_FAILURE);
+    }
+
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, n) < 0)
+        ok = 0;
+    for (unsigned i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+
+    free(probe);
+    return ok;
+}
+
+uring uring_create(unsigned depth) {
+    struct io_uring_params p;
+    uring r;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    if ((fd = syscall(__NR_io_uring_setup, depth, &p)) < 0)
+        return NULL;                  // old kernel, or io_uring disabled
+    if (!supports_ops(fd)) {
+        close(fd);
+        return NULL;                  // the ring exists but cannot read and write
+    }
+
+    r = malloc(sizeof(_uring));
+    if (r == NULL) {
+        perror("Error allocating memory for io_uring");
+        exit(EXIT_FAILURE);
+    }
+
+    r->fd      = fd;
+    r->depth   = depth;
+    r->pending = 0;
+    r->queued  = 0;
+    r->buffers = 0;
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_size    = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {   // both rings in one mapping
+        if (r->cq_ring_size > r->sq_ring_size)
+            r->sq_ring_size = r->cq_ring_size;
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP ? r->sq_ring :
+                 mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    r->sqes    = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+        if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_size);
+        if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_size);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    r->sq_tail  = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask  = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+    r->cq_head  = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+    r->cq_tail  = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask  = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+
+    return r;
+}
+
+void uring_destroy(uring r) {
+    munmap(r->sqes, r->sqes_size);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+    free(r);
+}
+
+int uring_register_buffers(uring r, struct iovec *iov, unsigned n) {
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+        return -1;
+
+    r->buffers = n;
+    return 0;
+}
+
+unsigned uring_pending(uring r) {
+    return r->pending;
+}
+
+unsigned uring_depth(uring r) {
+    return r->depth;
+}
+
+// The submission ring has at least depth entries and the kernel takes every
+// submitted entry in io_uring_enter, so there is always a free one
+static void prepare(uring r, int op, int fd, void *addr, uint32_t len, uint64_t offset, int buf_index, void *data) {
+    unsigned tail = *r->sq_tail;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[i];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = op;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t) addr;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = (uintptr_t) data;
+
+    r->sq_array[i] = i;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    r->pending++;
+}
+
+static int fixed(uring r, int buf_index) {
+    return buf_index >= 0 && (unsigned) buf_index < r->buffers;
+}
+
+void uring_read(uring r, int fd, void *buf, uint32_t len, uint64_t offset, int buf_index, void *data) {
+    if (fixed(r, buf_index))
+        prepare(r, IORING_OP_READ_FIXED, fd, buf, len, offset, buf_index, data);
+    else
+        prepare(r, IORING_OP_READ, fd, buf, len, offset, 0, data);
+}
+
+void uring_write(uring r, int fd, void *buf, uint32_t len, uint64_t offset, int buf_index, void *data) {
+    if (fixed(r, buf_index))
+        prepare(r, IORING_OP_WRITE_FIXED, fd, buf, len, offset, buf_index, data);
+    else
+        prepare(r, IORING_OP_WRITE, fd, buf, len, offset, 0, data);
+}
+
+void uring_writev(uring r, int fd, struct iovec *iov, int n, uint64_t offset, void *data) {
+    prepare(r, IORING_OP_WRITEV, fd, iov, n, offset, 0, data);
+}
+
+void uring_submit(uring r) {
+    while (r->queued > 0) {
+        int n = enter(r, r->queued, 0);
+
+        if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("Error submitting io_uring requests");
+            exit(EXIT_FAILURE);
+        }
+        if (n > 0)
+            r->queued -= n;
+    }
+}
+
+void *uring_wait(uring r, int *res) {
+    unsigned head = *r->cq_head;
+    struct io_uring_cqe *cqe;
+    void *data;
+
+    uring_submit(r);
+
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (enter(r, 0, 1) < 0 && errno != EINTR) {
+            perror("Error waiting for io_uring completions");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    cqe  = &r->cqes[head & *r->cq_mask];
+    data = (void *) (uintptr_t) cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->pending--;
+
+    return data;
+}
@@ -0,0 +1,34 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Minimal io_uring ring used by the reader and writer threads to keep several
+// reads and writes in flight. Requests are prepared with uring_read,
+// uring_write and uring_writev, sent to the kernel with uring_submit (or by
+// uring_wait) and completed with uring_wait, which returns the data pointer
+// given with the request. A ring must only be used by one thread.
+typedef struct _uring *uring;
+
+uring    uring_create(unsigned depth);   // Ring for up to depth requests in flight, NULL if io_uring is not available
+void     uring_destroy(uring r);         // Release the ring, every request must be completed
+
+// Register n buffers, requests on them pass their position in iov as
+// buf_index. Returns 0 on success, -1 if the kernel refuses them (usually
+// because of RLIMIT_MEMLOCK); buf_index is then ignored.
+int      uring_register_buffers(uring r, struct iovec *iov, unsigned n);
+
+unsigned uring_pending(uring r);         // Requests prepared and not yet completed
+unsigned uring_depth(uring r);           // Requests that can be in flight at the same time
+
+// Prepare a request at offset of fd. buf_index is a registered buffer that
+// contains buf, or -1. At most uring_depth requests can be pending.
+void     uring_read(uring r, int fd, void *buf, uint32_t len, uint64_t offset, int buf_index, void *data);
+void     uring_write(uring r, int fd, void *buf, uint32_t len, uint64_t offset, int buf_index, void *data);
+void     uring_writev(uring r, int fd, struct iovec *iov, int n, uint64_t offset, void *data);
+
+void     uring_submit(uring r);          // Send the prepared requests to the kernel
+void    *uring_wait(uring r, int *res);  // Wait for a request, res is the result of its read or write (-errno on error)
+
+#endif
@@ -4,9 +4,42 @@
 
 -export([init_archive_reader/2, init_archive_writer/2]).
 
--define(INT_SIZE, 32).
--define(INT_SIZE_BYTES, 4).
--define(HEADER_SIZE, 9).
+%% Version 2 to 4 archives use 64 bit sizes and offsets, version 1 archives 32 bit ones.
+%% Version 3 and 4 archives hold ?INCOMPLETE as chunk count until the writer is stopped.
+%% Version 4 archives store the uncompressed size of each chunk (?FIELDS integers per
+%% chunk header and tables in the index, instead of 3).
+%% Version 5 archives add the codec of the chunk data to the header. Only
+%% zlib (?CODEC_ZLIB) chunks can be written and read here.
+%% Version 6 archives end the chunks with an end record (chunk number ?END_CHUNK).
+%% Archives written to a pipe hold ?STREAMED as chunk count, the count is in the footer.
+%% Version 7 archives add the flags of each chunk (5 integers per chunk header
+%% and tables in the index); chunks with ?RAW are stored uncompressed and are sent
+%% to the decompression workers as raw_chunk. The writer always stores compressed chunks.
+%% Version 8 archives add the CRC32C of the uncompressed data of each chunk (?FIELDS
+%% integers), valid when the flags have ?CRC. It is sent with the chunk, or none.
+%% Version 9 archives add a directory between the index and the footer, listing the
+%% files of a container archive. The writer stores an empty one (a single file) and
+%% the reader refuses containers. Containers also have ?CONTAINER in the codec of
+%% the header, so they are refused before the chunks when read from a pipe.
+-define(VERSION, 9).
+-define(CODEC_ZLIB, 0).
+-define(CONTAINER, 16#10000).
+-define(FIELDS, 6).
+-define(RAW, 1).
+-define(CRC, 2).
+-define(VERSIONED, 16#FFFFFFFF).
+-define(INCOMPLETE, 16#FFFFFFFFFFFFFFFF).
+-define(STREAMED, 16#FFFFFFFFFFFFFFFE).
+-define(END_CHUNK, 16#FFFFFFFFFFFFFFFF).
+-define(INT_SIZE, 64).
+-define(INT_SIZE_BYTES, 8).
+-define(HEADER_SIZE, 25).
+-define(V2_HEADER_SIZE, 21).
+-define(CHUNKS_POSITION, 13).
+-define(V1_INT_SIZE, 32).
+-define(V1_HEADER_SIZE, 9).
+-define(FOOTER_SIZE, 21).
+-define(FOOTER_MAGIC, <<"CHIDX">>).
 
 %% Archive Writer
 
@@ -26,15 +59,11 @@ stop_archive_writer(Writer) ->
 init_archive_writer(File, From) ->
     case file:open(File, [write, binary]) of
         {ok, IoDev} ->
-            case file:write(IoDev, <<"CHUNK">>) of
+            case file:write(IoDev, <<"CHUNK", ?VERSIONED:32/integer-unsigned-little, ?VERSION:32/integer-unsigned-little,
+                                     ?INCOMPLETE:?INT_SIZE/integer-unsigned-little, ?CODEC_ZLIB:32/integer-unsigned-little>>) of
                 ok ->
-                    case file:write(IoDev, <<0:?INT_SIZE/integer-unsigned-little>>) of
-                        ok ->
-                            From ! archive_writer_init_ok,
-                            archive_writer_loop(IoDev, 0);
-                        {error, Reason} ->
-                            From ! {archive_writer_init_error, Reason}
-                    end;
+                    From ! archive_writer_init_ok,
+                    archive_writer_loop(IoDev, 0, ?HEADER_SIZE, []);
                 {error, Reason} ->
                     From ! {archive_writer_init_error, Reason}
             end;
@@ -42,21 +71,43 @@ init_archive_writer(File, From) ->
             From ! {archive_writer_init_error, Reason}
     end.
 
-archive_writer_loop(IoDev, Chunks) ->
+%% Chunks are appended at End; the chunk count is only written when the writer stops
+archive_writer_loop(IoDev, Chunks, End, Index) ->
     receive
-        {add_chunk, Num, Offset, Data} ->
+        {add_chunk, Num, Offset, Orig_Size, Crc, Data} ->
             Flat_Data = list_to_binary(Data),
-            file:position(IoDev, eof),
             Size = size(Flat_Data),
             file:write(IoDev, <<Size:?INT_SIZE/integer-unsigned-little, Num:?INT_SIZE/integer-unsigned-little,
-                                Offset:?INT_SIZE/integer-unsigned-little, Flat_Data/binary>>),
-            file:position(IoDev, 5),
-            file:write(IoDev, <<(Chunks+1):?INT_SIZE/integer-unsigned-little>>),
-            archive_writer_loop(IoDev, Chunks+1);
+                                Offset:?INT_SIZE/integer-unsigned-little, Orig_Size:?INT_SIZE/integer-unsigned-little,
+                                ?CRC:?INT_SIZE/integer-unsigned-little, Crc:?INT_SIZE/integer-unsigned-little,
+                                Flat_Data/binary>>),
+            archive_writer_loop(IoDev, Chunks+1, End+?FIELDS*?INT_SIZE_BYTES+Size,
+                                [{Num, End+?FIELDS*?INT_SIZE_BYTES, Offset, Size, Orig_Size, Crc} | Index]);
         stop ->
-            ok
+            write_index(IoDev, Chunks, End, Index)
     end.
 
+%% End record, then the index block: archive offsets, file offsets, sizes, uncompressed sizes, flags
+%% and checksums ordered by chunk number, an empty directory (no files), and the footer
+%% <<Index_Offset, Chunks, "CHIDX">>. The chunk
+%% count replaces ?INCOMPLETE in the header once the rest of the archive is on disk.
+write_index(IoDev, Chunks, End, Index) ->
+    Index_Offset = End+?FIELDS*?INT_SIZE_BYTES,
+    Sorted = lists:keysort(1, Index),
+    Archive_Offsets = << <<A:?INT_SIZE/integer-unsigned-little>> || {_, A, _, _, _, _} <- Sorted >>,
+    File_Offsets    = << <<F:?INT_SIZE/integer-unsigned-little>> || {_, _, F, _, _, _} <- Sorted >>,
+    Sizes           = << <<S:?INT_SIZE/integer-unsigned-little>> || {_, _, _, S, _, _} <- Sorted >>,
+    Orig_Sizes      = << <<O:?INT_SIZE/integer-unsigned-little>> || {_, _, _, _, O, _} <- Sorted >>,
+    Flags           = << <<?CRC:?INT_SIZE/integer-unsigned-little>> || _ <- Sorted >>,
+    Crcs            = << <<C:?INT_SIZE/integer-unsigned-little>> || {_, _, _, _, _, C} <- Sorted >>,
+    file:write(IoDev, [<<0:?INT_SIZE, ?END_CHUNK:?INT_SIZE/integer-unsigned-little, 0:?INT_SIZE, 0:?INT_SIZE, 0:?INT_SIZE, 0:?INT_SIZE>>,
+                       Archive_Offsets, File_Offsets, Sizes, Orig_Sizes, Flags, Crcs, <<0:?INT_SIZE>>,
+                       <<Index_Offset:?INT_SIZE/integer-unsigned-little, Chunks:?INT_SIZE/integer-unsigned-little>>,
+                       ?FOOTER_MAGIC]),
+    file:datasync(IoDev),
+    file:pwrite(IoDev, ?CHUNKS_POSITION, <<Chunks:?INT_SIZE/integer-unsigned-little>>),
+    file:close(IoDev).
+
 %% Archive Reader
 
 start_archive_reader(File) ->
@@ -77,14 +128,17 @@ init_archive_reader(File, From) ->
         {ok, IoDev} ->
             case file:read(IoDev, 5) of
                 {ok, <<"CHUNK">>} ->
-                    case file:read(IoDev, ?INT_SIZE_BYTES) of
-                        {ok, <<Chunks:?INT_SIZE/integer-unsigned-little>>} ->
-                            From ! archive_reader_init_ok,
-                            archive_reader_loop(IoDev, File, Chunks, 0, read_chunk_map(IoDev, Chunks));
+                    case read_header(IoDev) of
+                        {ok, Chunks, Int_Size, Header_Size, Fields} ->
+                            case read_chunk_map(IoDev, Chunks, Int_Size, Header_Size, Fields) of
+                                {ok, Chunk_Map} ->
+                                    From ! archive_reader_init_ok,
+                                    archive_reader_loop(IoDev, File, Chunks, 0, Chunk_Map);
+                                {error, Reason} ->
+                                    From ! {archive_reader_init_error, Reason}
+                            end;
                         {error, Reason} ->
-                            From ! {archive_reader_init_error, Reason};
-                        _ ->
-                            From ! {archive_reader_init_error, not_a_chunk_file}
+                            From ! {archive_reader_init_error, Reason}
                     end;
                 {error, Reason} ->
                     From ! {archive_reader_init_error, Reason};
@@ -95,6 +149,67 @@ init_archive_reader(File, From) ->
             From ! {archive_reader_init_error, Reason}
     end.
 
+%% Returns the chunk count, the integer and header sizes and the number of
+%% integers in a chunk header of the archive version
+read_header(IoDev) ->
+    case file:read(IoDev, 4) of
+        {ok, <<?VERSIONED:32/integer-unsigned-little>>} ->
+            case file:read(IoDev, 4+?INT_SIZE_BYTES) of
+                {ok, <<_:32, ?INCOMPLETE:?INT_SIZE/integer-unsigned-little>>} ->
+                    {error, incomplete_archive};
+                {ok, <<Version:32/integer-unsigned-little, Chunks:?INT_SIZE/integer-unsigned-little>>} when Version >= 5, Version =< ?VERSION ->
+                    case file:read(IoDev, 4) of
+                        {ok, <<?CODEC_ZLIB:32/integer-unsigned-little>>} when Chunks == ?STREAMED ->
+                            footer_chunks(IoDev, fields(Version));
+                        {ok, <<?CODEC_ZLIB:32/integer-unsigned-little>>} ->
+                            {ok, Chunks, ?INT_SIZE, ?HEADER_SIZE, fields(Version)};
+                        {ok, <<Codec:32/integer-unsigned-little>>} when Codec band ?CONTAINER =/= 0 ->
+                            {error, container_archive};
+                        {ok, <<_:32>>} ->
+                            {error, unsupported_codec};
+                        {error, Reason} ->
+                            {error, Reason};
+                        _ ->
+                            {error, not_a_chunk_file}
+                    end;
+                {ok, <<4:32/integer-unsigned-little, Chunks:?INT_SIZE/integer-unsigned-little>>} ->
+                    {ok, Chunks, ?INT_SIZE, ?V2_HEADER_SIZE, 4};
+                {ok, <<Version:32/integer-unsigned-little, Chunks:?INT_SIZE/integer-unsigned-little>>} when Version < 4 ->
+                    {ok, Chunks, ?INT_SIZE, ?V2_HEADER_SIZE, 3};
+                {ok, <<_:32, _:?INT_SIZE>>} ->
+                    {error, unsupported_version};
+                {error, Reason} ->
+                    {error, Reason};
+                _ ->
+                    {error, not_a_chunk_file}
+            end;
+        {ok, <<Chunks:?V1_INT_SIZE/integer-unsigned-little>>} ->
+            {ok, Chunks, ?V1_INT_SIZE, ?V1_HEADER_SIZE, 3};
+        {error, Reason} ->
+            {error, Reason};
+        _ ->
+            {error, not_a_chunk_file}
+    end.
+
+%% Integers in a chunk header of version 5 and later archives
+fields(Version) when Version >= 8 -> ?FIELDS;
+fields(7) -> 5;
+fields(_) -> 4.
+
+%% The chunk count of a streamed archive is only in the footer
+footer_chunks(IoDev, Fields) ->
+    case file:position(IoDev, eof) of
+        {ok, End} when End >= ?HEADER_SIZE+?FOOTER_SIZE ->
+            case file:pread(IoDev, End-?FOOTER_SIZE, ?FOOTER_SIZE) of
+                {ok, <<_:?INT_SIZE, Chunks:?INT_SIZE/integer-unsigned-little, "CHIDX">>} ->
+                    {ok, Chunks, ?INT_SIZE, ?HEADER_SIZE, Fields};
+                _ ->
+                    {error, incomplete_archive}
+            end;
+        _ ->
+            {error, incomplete_archive}
+    end.
+
 archive_reader_loop(IoDev, File, Chunks, Current_Chunk, Chunk_Map) ->
     receive
         {get_chunk, From} ->
@@ -104,10 +219,17 @@ archive_reader_loop(IoDev, File, Chunks, Current_Chunk, Chunk_Map) ->
                     archive_reader_loop(IoDev, File, Chunks, Current_Chunk, Chunk_Map);
                 true ->
                     try
-                        #{Current_Chunk := {Size, File_Offset, Archive_Offset}} = Chunk_Map,
+                        #{Current_Chunk := {Size, File_Offset, Archive_Offset, Flags, Crc}} = Chunk_Map,
                         file:position(IoDev, Archive_Offset),
                         {ok, Data} = file:read(IoDev, Size),
-                        From ! {chunk, Current_Chunk, File_Offset, Data}
+                        Check = if
+                                    Flags band ?CRC =/= 0 -> Crc;
+                                    true                  -> none
+                                end,
+                        if
+                            Flags band ?RAW =/= 0 -> From ! {raw_chunk, Current_Chunk, File_Offset, Check, Data};
+                            true                  -> From ! {chunk, Current_Chunk, File_Offset, Check, Data}
+                        end
                     catch
                         badmatch -> From ! {error, no_chunk}
                     end,
@@ -120,12 +242,66 @@ archive_reader_loop(IoDev, File, Chunks, Current_Chunk, Chunk_Map) ->
     end.
 
 
-read_chunk_map(_, 0, _, Map) ->
+read_chunk_map(_, 0, _, _, _, Map) ->
     Map;
-read_chunk_map(IoDev, Chunks, Archive_Offset, Map) ->
+read_chunk_map(IoDev, Chunks, Int_Size, Fields, Archive_Offset, Map) ->
+    Int_Bytes = Int_Size div 8,
     file:position(IoDev, Archive_Offset),
-    {ok, <<Size:?INT_SIZE/integer-unsigned-little, Num:?INT_SIZE/integer-unsigned-little, File_Offset:?INT_SIZE/integer-unsigned-little>>} = file:read(IoDev, ?INT_SIZE_BYTES*3),
-    read_chunk_map(IoDev, Chunks-1, Archive_Offset+Size+3*?INT_SIZE_BYTES, Map#{Num => {Size, File_Offset, Archive_Offset+?INT_SIZE_BYTES*3}}).
+    {ok, <<Size:Int_Size/integer-unsigned-little, Num:Int_Size/integer-unsigned-little, File_Offset:Int_Size/integer-unsigned-little, Rest/binary>>} = file:read(IoDev, Int_Bytes*Fields),
+    {Flags, Crc} = case Rest of
+                       <<_:Int_Size, F:Int_Size/integer-unsigned-little, C:Int_Size/integer-unsigned-little>> -> {F, C};
+                       <<_:Int_Size, F:Int_Size/integer-unsigned-little>> -> {F, 0};
+                       _ -> {0, 0}
+                   end,
+    read_chunk_map(IoDev, Chunks-1, Int_Size, Fields, Archive_Offset+Size+Fields*Int_Bytes, Map#{Num => {Size, File_Offset, Archive_Offset+Int_Bytes*Fields, Flags, Crc}}).
+
+read_chunk_map(IoDev, Chunks, Int_Size, Header_Size, Fields) ->
+    case read_index(IoDev, Chunks, Int_Size, Fields) of
+        {ok, Map}       -> {ok, Map};
+        {error, Reason} -> {error, Reason};
+        no_index        -> {ok, read_chunk_map(IoDev, Chunks, Int_Size, Fields, Header_Size, #{})}
+    end.
+
+%% Load the chunk map from the index block, if the archive has a footer.
+%% Containers (a directory with files after the index) cannot be read.
+read_index(IoDev, Chunks, Int_Size, Tables) ->
+    Table_Size = Chunks*(Int_Size div 8),
+    Footer_Size = 2*(Int_Size div 8)+5,
+    case file:position(IoDev, eof) of
+        {ok, End} when End >= Footer_Size ->
+            case file:pread(IoDev, End-Footer_Size, Footer_Size) of
+                {ok, <<Index_Offset:Int_Size/integer-unsigned-little, Chunks:Int_Size/integer-unsigned-little, "CHIDX">>}
+                  when Index_Offset+Tables*Table_Size+Footer_Size =< End ->
+                    Dir_Offset = Index_Offset+Tables*Table_Size,
+                    case Dir_Offset+Footer_Size == End orelse file:pread(IoDev, Dir_Offset, 8) == {ok, <<0:64>>} of
+                        true  -> read_tables(IoDev, Index_Offset, Chunks, Int_Size, Tables, Table_Size);
+                        false -> {error, container_archive}
+                    end;
+                _ ->
+                    no_index
+            end;
+        _ ->
+            no_index
+    end.
 
-read_chunk_map(IoDev, Chunks) ->
-    read_chunk_map(IoDev, Chunks, ?HEADER_SIZE, #{}).
+read_tables(IoDev, Index_Offset, Chunks, Int_Size, Tables, Table_Size) ->
+    case file:pread(IoDev, Index_Offset, Tables*Table_Size) of
+        {ok, <<Archive_Offsets:Table_Size/binary, File_Offsets:Table_Size/binary, Sizes:Table_Size/binary, _:Table_Size/binary, Flags:Table_Size/binary, Crcs:Table_Size/binary>>} ->
+            {ok, index_map(Archive_Offsets, File_Offsets, Sizes, Flags, Crcs, Int_Size, 0, #{})};
+        {ok, <<Archive_Offsets:Table_Size/binary, File_Offsets:Table_Size/binary, Sizes:Table_Size/binary, _:Table_Size/binary, Flags:Table_Size/binary>>} ->
+            {ok, index_map(Archive_Offsets, File_Offsets, Sizes, Flags, <<0:(Chunks*Int_Size)>>, Int_Size, 0, #{})};
+        {ok, <<Archive_Offsets:Table_Size/binary, File_Offsets:Table_Size/binary, Sizes:Table_Size/binary, _/binary>>} ->
+            {ok, index_map(Archive_Offsets, File_Offsets, Sizes, <<0:(Chunks*Int_Size)>>, <<0:(Chunks*Int_Size)>>, Int_Size, 0, #{})};
+        _ ->
+            no_index
+    end.
+
+index_map(<<>>, <<>>, <<>>, <<>>, <<>>, _, _, Map) ->
+    Map;
+index_map(Archive_Offsets, File_Offsets, Sizes, Flags, Crcs, Int_Size, Num, Map) ->
+    <<A:Int_Size/integer-unsigned-little, As/binary>> = Archive_Offsets,
+    <<F:Int_Size/integer-unsigned-little, Fs/binary>> = File_Offsets,
+    <<S:Int_Size/integer-unsigned-little, Ss/binary>> = Sizes,
+    <<G:Int_Size/integer-unsigned-little, Gs/binary>> = Flags,
+    <<C:Int_Size/integer-unsigned-little, Cs/binary>> = Crcs,
+    index_map(As, Fs, Ss, Gs, Cs, Int_Size, Num+1, Map#{Num => {S, F, A, G, C}}).
@@ -1,8 +1,9 @@
 -module(comp).
 
--export([comp/1, comp/2 , decomp/1, decomp/2,comp_proc/2, comp_proc/3,decomp_proc/2,decomp_proc/3]).
+-export([comp/1, comp/2 , decomp/1, decomp/2,comp_proc/2, comp_proc/3, comp_proc/4,decomp_proc/2,decomp_proc/3]).
 
 -define(DEFAULT_CHUNK_SIZE, 1024*1024).
+-define(DEFAULT_LEVEL, 9).
 
 %%% File Compression
 
@@ -26,12 +27,15 @@ comp_proc(File, Procs) ->
     comp_proc(File, ?DEFAULT_CHUNK_SIZE, Procs).
 
 comp_proc(File, Chunk_Size, Procs) ->
+    comp_proc(File, Chunk_Size, Procs, ?DEFAULT_LEVEL).
+
+comp_proc(File, Chunk_Size, Procs, Level) ->  %% Level is the zlib compression level (0..9)
     case file_service:start_file_reader(File, Chunk_Size) of
         {ok, Reader} ->
             ArchiveFile = File ++ ".ch",
             case archive:start_archive_writer(ArchiveFile) of
                 {ok, Writer} ->
-                    spawn_multiple_compression_workers(Reader, Writer, Procs),
+                    spawn_multiple_compression_workers(Reader, Writer, Procs, Level),
                     wait(Procs),
                     Reader !stop,
                     Writer ! stop,
@@ -53,18 +57,18 @@ wait(N) ->
         termine -> wait(N - 1)
     end.
 
-spawn_multiple_compression_workers(_Reader, _Writer, 0) -> ok;
-spawn_multiple_compression_workers(Reader, Writer, Procs) ->
+spawn_multiple_compression_workers(_Reader, _Writer, 0, _Level) -> ok;
+spawn_multiple_compression_workers(Reader, Writer, Procs, Level) ->
     MyPid = self(),
-    spawn_link(fun() -> comp_loop2(Reader, Writer, MyPid) end),
-    spawn_multiple_compression_workers(Reader, Writer, Procs - 1).
+    spawn_link(fun() -> comp_loop2(Reader, Writer, MyPid, Level) end),
+    spawn_multiple_compression_workers(Reader, Writer, Procs - 1, Level).
 
 comp_loop(Reader, Writer) ->  %% Compression loop => get a chunk, compress it, send to writer
     Reader ! {get_chunk, self()},  %% request a chunk from the file reader
     receive
         {chunk, Num, Offset, Data} ->   %% got one, compress and send to writer
             Comp_Data = compress:compress(Data),
-            Writer ! {add_chunk, Num, Offset, Comp_Data},
+            Writer ! {add_chunk, Num, Offset, byte_size(Data), compress:crc32c(Data), Comp_Data},
             comp_loop(Reader, Writer);
         eof ->  %% end of file, stop reader and writer
             Writer !stop,
@@ -75,13 +79,13 @@ comp_loop(Reader, Writer) ->  %% Compression loop => get a chunk, compress it, s
             Writer ! abort
     end.
 
-comp_loop2(Reader, Writer, Parent) ->  %% Compression loop => get a chunk, compress it, send to writer
+comp_loop2(Reader, Writer, Parent, Level) ->  %% Compression loop => get a chunk, compress it, send to writer
     Reader ! {get_chunk, self()},  %% request a chunk from the file reader
     receive
         {chunk, Num, Offset, Data} ->   %% got one, compress and send to writer
-            Comp_Data = compress:compress(Data),
-            Writer ! {add_chunk, Num, Offset, Comp_Data},
-            comp_loop2(Reader, Writer,Parent);
+            Comp_Data = compress:compress(Data, Level),
+            Writer ! {add_chunk, Num, Offset, byte_size(Data), compress:crc32c(Data), Comp_Data},
+            comp_loop2(Reader, Writer, Parent, Level);
         eof ->  %% end of file, stop reader and writer
             Parent ! termine;
         {error, Reason} ->
@@ -141,10 +145,17 @@ spawn_multiple_decompression_workers(Reader, Writer, Procs) ->
 decomp_loop(Reader, Writer) ->
     Reader ! {get_chunk, self()},  %% request a chunk from the reader
     receive
-        {chunk, _Num, Offset, Comp_Data} ->  %% got one
-            Data = compress:decompress(Comp_Data),
-            Writer ! {write_chunk, Offset, Data},
-            decomp_loop(Reader, Writer);
+        {Kind, Num, Offset, Crc, Stored} when Kind == chunk; Kind == raw_chunk ->  %% got one
+            Data = chunk_data(Kind, Stored),
+            case compress:check_crc32c(Crc, Data) of
+                true ->
+                    Writer ! {write_chunk, Offset, Data},
+                    decomp_loop(Reader, Writer);
+                false ->
+                    io:format("Chunk ~w is corrupted (checksum mismatch)~n", [Num]),
+                    Writer ! abort,
+                    Reader ! stop
+            end;
         eof ->    %% end of file => exit decompression
             Reader ! stop,
             Writer ! stop;
@@ -157,10 +168,17 @@ decomp_loop(Reader, Writer) ->
 decomp_loop2(Reader, Writer,Parent) ->
     Reader ! {get_chunk, self()},  %% request a chunk from the reader
     receive
-        {chunk, _Num, Offset, Comp_Data} ->  %% got one
-            Data = compress:decompress(Comp_Data),
-            Writer ! {write_chunk, Offset, Data},
-            decomp_loop2(Reader, Writer,Parent);
+        {Kind, Num, Offset, Crc, Stored} when Kind == chunk; Kind == raw_chunk ->  %% got one
+            Data = chunk_data(Kind, Stored),
+            case compress:check_crc32c(Crc, Data) of
+                true ->
+                    Writer ! {write_chunk, Offset, Data},
+                    decomp_loop2(Reader, Writer,Parent);
+                false ->
+                    io:format("Chunk ~w is corrupted (checksum mismatch)~n", [Num]),
+                    Writer ! abort,
+                    Reader ! stop
+            end;
         eof ->    %% end of file => exit decompression
             Parent !termine;
         {error, Reason} ->
@@ -168,3 +186,7 @@ decomp_loop2(Reader, Writer,Parent) ->
             Writer ! abort,
             Reader ! stop
     end.
+
+%% Raw chunks are stored uncompressed
+chunk_data(chunk, Comp_Data) -> compress:decompress(Comp_Data);
+chunk_data(raw_chunk, Data)  -> Data.
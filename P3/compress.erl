@@ -1,14 +1,23 @@
 -module(compress).
 
--export([compress/1, decompress/1]).
+-export([compress/1, compress/2, compress/3, decompress/1, crc32c/1, check_crc32c/2]).
 
 -define(BEST_COMPRESSION, 9).
+-define(CRC32C_POLY, 16#82F63B78).  %% Castagnoli polynomial, bit reversed
 
 compress(Data) ->
+    compress(Data, ?BEST_COMPRESSION).
+
+compress(Data, Level) ->
+    compress(Data, Level, default).
+
+%% Level is 0..9, Strategy one of default, filtered, huffman_only, rle
+compress(Data, Level, Strategy) ->
     Z = zlib:open(),
-    zlib:deflateInit(Z, ?BEST_COMPRESSION),
+    zlib:deflateInit(Z, Level, deflated, 15, 8, Strategy),
     Comp_data = zlib:deflate(Z, Data, finish),
     zlib:deflateEnd(Z),
+    zlib:close(Z),
     Comp_data.
 
 decompress(Comp_Data) ->
@@ -17,3 +26,59 @@ decompress(Comp_Data) ->
     Data = zlib:inflate(Z, Comp_Data),
     zlib:inflateEnd(Z),
     Data.
+
+%% CRC32C of the uncompressed data of a chunk, as stored in version 8 archives.
+%% Slicing-by-8: every step takes 8 bytes and looks them up in 8 tables, one
+%% per byte position, so the loop runs once per 8 bytes instead of once per
+%% byte. The bytes are matched one by one rather than as a 64 bit word, which
+%% would not fit in a small integer.
+crc32c(Data) ->
+    crc32c(iolist_to_binary(Data), crc32c_table(), 16#FFFFFFFF) bxor 16#FFFFFFFF.
+
+crc32c(<<B0, B1, B2, B3, B4, B5, B6, B7, Rest/binary>>, Table, Crc) ->
+    Crc1 = element(7*256 + ((Crc bxor B0) band 16#FF) + 1, Table) bxor
+           element(6*256 + (((Crc bsr 8) bxor B1) band 16#FF) + 1, Table) bxor
+           element(5*256 + (((Crc bsr 16) bxor B2) band 16#FF) + 1, Table) bxor
+           element(4*256 + ((Crc bsr 24) bxor B3) + 1, Table) bxor
+           element(3*256 + B4 + 1, Table) bxor
+           element(2*256 + B5 + 1, Table) bxor
+           element(256 + B6 + 1, Table) bxor
+           element(B7 + 1, Table),
+    crc32c(Rest, Table, Crc1);
+crc32c(<<B, Rest/binary>>, Table, Crc) ->
+    crc32c(Rest, Table, (Crc bsr 8) bxor element(((Crc bxor B) band 16#FF) + 1, Table));
+crc32c(<<>>, _, Crc) ->
+    Crc.
+
+%% Crc is none for chunks of archives without checksums
+check_crc32c(none, _) ->
+    true;
+check_crc32c(Crc, Data) ->
+    crc32c(Data) == Crc.
+
+%% The 8 tables are built once and kept as a persistent term, in one tuple of
+%% 8*256 entries: entry K*256+I is the CRC of byte I followed by K zero bytes
+crc32c_table() ->
+    case persistent_term:get({?MODULE, crc32c_tables}, undefined) of
+        undefined ->
+            T0 = list_to_tuple([crc32c_entry(B, 8) || B <- lists:seq(0, 255)]),
+            Table = list_to_tuple(lists:append(crc32c_tables(T0, tuple_to_list(T0), 8))),
+            persistent_term:put({?MODULE, crc32c_tables}, Table),
+            Table;
+        Table ->
+            Table
+    end.
+
+%% T is the next table to emit, T0 the table of a single byte
+crc32c_tables(_, _, 0) ->
+    [];
+crc32c_tables(T0, T, N) ->
+    Next = [(Crc bsr 8) bxor element((Crc band 16#FF) + 1, T0) || Crc <- T],
+    [T | crc32c_tables(T0, Next, N-1)].
+
+crc32c_entry(Crc, 0) ->
+    Crc;
+crc32c_entry(Crc, Bits) when Crc band 1 == 1 ->
+    crc32c_entry((Crc bsr 1) bxor ?CRC32C_POLY, Bits-1);
+crc32c_entry(Crc, Bits) ->
+    crc32c_entry(Crc bsr 1, Bits-1).